@@ -0,0 +1,308 @@
+#include "alloc.h"
+#include "output.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define DEFAULT_OPS (8ULL * 1000 * 1000) /**< Churn operations run unless --ops says otherwise */
+#define DEFAULT_LIVE_MIB 64 /**< Live bytes held through the churn unless --live-mib says otherwise, in MiB */
+#define EPOCHS 8 /**< Times the churn shifts to the next size distribution */
+#define SAMPLE_INTERVAL 65536 /**< Operations between samples */
+#define TEARDOWN_SHARE 0.75 /**< Share of the blocks freed by the teardown */
+#define MIN_SIZE 16 /**< Smallest size any distribution asks for */
+
+/*
+ * A long-running workload for watching fragmentation, compressing what a
+ * service's heap sees over weeks into a few million operations:
+ *
+ *     tumalloc_frag_bench [--engine tumalloc|libc] [--ops N] [--live-mib M] > frag.csv
+ *
+ *     build-up  Allocate small blocks until M MiB are live.
+ *     churn     N operations that each free a random block while more than
+ *               M MiB are live and allocate one otherwise, shifting to the
+ *               next size distribution every N / EPOCHS operations: small,
+ *               medium, power-law and large sizes in turn, so blocks of
+ *               one era are freed among the survivors of another.
+ *     teardown  Free TEARDOWN_SHARE of the blocks, chosen at random.
+ *
+ * Every SAMPLE_INTERVAL operations, and at the end of each phase, it prints a
+ * CSV row of the bytes live, the allocator's footprint and the resident set
+ * size. The footprint is what the allocator holds from the system:
+ * tumalloc_stats' mapped bytes for tumalloc and mallinfo2's arena and mmapped
+ * bytes for libc. The resident set counts the whole process, from a baseline
+ * taken before the build-up, and takes in the benchmark's own table of blocks,
+ * 16 bytes a block. Lines starting with # are comments, ending with a summary.
+ *
+ * The benchmark runs one allocator per process, so that the resident set is
+ * that allocator's alone. Its table of blocks is mapped outside both.
+ */
+
+/**
+ * A block the workload holds
+ */
+typedef struct block {
+    void *ptr; /**< The block */
+    size_t size; /**< The size asked for */
+} block;
+
+/**
+ * A size distribution of the churn
+ */
+typedef struct distribution {
+    const char *name; /**< Name in the comments */
+    size_t min; /**< Smallest size */
+    size_t max; /**< Largest size */
+    int power; /**< Non-zero to draw from a power law, favouring small sizes, rather than uniformly */
+} distribution;
+
+/**
+ * An allocator to run the workload on
+ */
+typedef struct engine {
+    const char *name; /**< Name given to --engine */
+    void *(*malloc)(size_t size); /**< Allocate */
+    void (*free)(void *ptr); /**< Free */
+    size_t (*footprint)(void); /**< Bytes the allocator holds from the system */
+} engine;
+
+static const distribution DISTRIBUTIONS[] = { /**< The churn's distributions, in the order it shifts through them */
+    { "small", MIN_SIZE, 256, 0 },
+    { "medium", 256, 4096, 0 },
+    { "power-law", MIN_SIZE, 65536, 1 },
+    { "large", 4096, 131072, 0 },
+};
+
+static block *BLOCKS; /**< The blocks held, in no order */
+static size_t BLOCK_COUNT; /**< Number of blocks held */
+static size_t BLOCK_CAPACITY; /**< Room in BLOCKS */
+static size_t LIVE; /**< Bytes asked for by the blocks held */
+static uint64_t RNG_STATE = 0x9e3779b97f4a7c15u; /**< State of the generator */
+
+/**
+ * Allocate from tumalloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *tu_engine_malloc(size_t size) {
+    return tumalloc(size);
+}
+
+/**
+ * Free a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ */
+static void tu_engine_free(void *ptr) {
+    tufree(ptr);
+}
+
+/**
+ * Read tumalloc's footprint
+ *
+ * @return The bytes tumalloc has mapped for blocks
+ */
+static size_t tu_engine_footprint(void) {
+    tu_stats stats;
+    tumalloc_stats(&stats);
+    return stats.mapped;
+}
+
+/**
+ * Read the libc allocator's footprint
+ *
+ * @return The bytes of its arenas and of its mmapped blocks
+ */
+static size_t libc_footprint(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static const engine ENGINES[] = { /**< Engines --engine can pick, the default first */
+    { "tumalloc", tu_engine_malloc, tu_engine_free, tu_engine_footprint },
+    { "libc", malloc, free, libc_footprint },
+};
+
+/**
+ * Draw the next number from a xorshift generator
+ *
+ * @return A random 64-bit number
+ */
+static uint64_t next_random(void) {
+    RNG_STATE ^= RNG_STATE << 13;
+    RNG_STATE ^= RNG_STATE >> 7;
+    RNG_STATE ^= RNG_STATE << 17;
+    return RNG_STATE;
+}
+
+/**
+ * Draw a size from a distribution
+ *
+ * @param dist The distribution
+ * @return The size
+ */
+static size_t draw_size(const distribution *dist) {
+    if (!dist->power)
+        return dist->min + next_random() % (dist->max - dist->min + 1);
+
+    // Inverse of the bounded Pareto distribution's CDF with exponent 1, which most requests land low in
+    double u = (double) (next_random() >> 11) / (double) (1ULL << 53);
+    double low = (double) dist->min, high = (double) dist->max;
+    double size = high * low / (high - u * (high - low));
+    return size > high ? dist->max : (size_t) size;
+}
+
+/**
+ * Allocate a block, write to it and hold it
+ *
+ * @param eng The allocator
+ * @param size The amount of memory to allocate
+ */
+static void hold(const engine *eng, size_t size) {
+    if (BLOCK_COUNT == BLOCK_CAPACITY) {
+        fprintf(stderr, "block table is full\n");
+        exit(1);
+    }
+    char *ptr = eng->malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s failed to allocate %zu bytes\n", eng->name, size);
+        exit(1);
+    }
+    // Touch every page, as a program filling the block would
+    for (size_t i = 0; i < size; i += 4096) {
+        ptr[i] = 1;
+    }
+    BLOCKS[BLOCK_COUNT++] = (block) { ptr, size };
+    LIVE += size;
+}
+
+/**
+ * Free a random block the workload holds
+ *
+ * @param eng The allocator
+ */
+static void drop(const engine *eng) {
+    // Move the last block into the hole, so the table stays dense
+    size_t i = next_random() % BLOCK_COUNT;
+    eng->free(BLOCKS[i].ptr);
+    LIVE -= BLOCKS[i].size;
+    BLOCKS[i] = BLOCKS[--BLOCK_COUNT];
+}
+
+/**
+ * Print a row of the time series
+ *
+ * @param eng The allocator
+ * @param ops Operations run so far
+ * @param phase The phase running
+ * @param baseline The resident set size before the build-up
+ * @param peak_rss Raised to the resident set size above the baseline if that is higher
+ */
+static void sample(const engine *eng, uint64_t ops, const char *phase, size_t baseline, size_t *peak_rss) {
+    size_t footprint = eng->footprint();
+    size_t resident = tu_resident_bytes();
+    size_t rss = resident > baseline ? resident - baseline : 0;
+    if (rss > *peak_rss)
+        *peak_rss = rss;
+    printf("%llu,%s,%zu,%zu,%zu,%zu,%.3f,%.3f\n", (unsigned long long) ops, phase, BLOCK_COUNT, LIVE, footprint, rss,
+           LIVE ? (double) footprint / LIVE : 0.0, LIVE ? (double) rss / LIVE : 0.0);
+}
+
+/**
+ * Run the phased workload on one allocator and print its time series
+ */
+int main(int argc, char **argv) {
+    const engine *eng = &ENGINES[0];
+    uint64_t churn_ops = DEFAULT_OPS;
+    size_t live_target = (size_t) DEFAULT_LIVE_MIB << 20;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            eng = NULL;
+            for (size_t e = 0; e < sizeof(ENGINES) / sizeof(ENGINES[0]); e++) {
+                if (strcmp(argv[i], ENGINES[e].name) == 0)
+                    eng = &ENGINES[e];
+            }
+            if (eng == NULL) {
+                fprintf(stderr, "unknown engine %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc) {
+            churn_ops = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--live-mib") == 0 && i + 1 < argc) {
+            live_target = (size_t) strtoull(argv[++i], NULL, 10) << 20;
+        } else {
+            fprintf(stderr, "usage: %s [--engine tumalloc|libc] [--ops N] [--live-mib M]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (churn_ops < EPOCHS)
+        churn_ops = EPOCHS;
+
+    // Enough room for the live target in the smallest blocks, plus the one allocation that crosses it
+    BLOCK_CAPACITY = live_target / MIN_SIZE + 1;
+    BLOCKS = mmap(NULL, BLOCK_CAPACITY * sizeof(block), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (BLOCKS == MAP_FAILED) {
+        fprintf(stderr, "failed to map the block table\n");
+        return 1;
+    }
+
+    printf("# engine %s, %llu churn ops, %zu MiB live target\n", eng->name, (unsigned long long) churn_ops,
+           live_target >> 20);
+    printf("ops,phase,blocks,live_bytes,footprint_bytes,rss_bytes,footprint_over_live,rss_over_live\n");
+    fflush(stdout);
+    size_t baseline = tu_resident_bytes();
+    size_t peak_rss = 0;
+    uint64_t ops = 0;
+    double start = (double) clock() / CLOCKS_PER_SEC;
+
+    while (LIVE < live_target) {
+        hold(eng, draw_size(&DISTRIBUTIONS[0]));
+        if (++ops % SAMPLE_INTERVAL == 0)
+            sample(eng, ops, "build-up", baseline, &peak_rss);
+    }
+    sample(eng, ops, "build-up", baseline, &peak_rss);
+
+    uint64_t epoch_ops = churn_ops / EPOCHS;
+    size_t distributions = sizeof(DISTRIBUTIONS) / sizeof(DISTRIBUTIONS[0]);
+    for (unsigned epoch = 0; epoch < EPOCHS; epoch++) {
+        const distribution *dist = &DISTRIBUTIONS[epoch % distributions];
+        printf("# epoch %u: %s sizes, %zu to %zu bytes\n", epoch, dist->name, dist->min, dist->max);
+        for (uint64_t i = 0; i < epoch_ops; i++) {
+            if (LIVE > live_target && BLOCK_COUNT > 0)
+                drop(eng);
+            else
+                hold(eng, draw_size(dist));
+            if (++ops % SAMPLE_INTERVAL == 0)
+                sample(eng, ops, "churn", baseline, &peak_rss);
+        }
+    }
+    sample(eng, ops, "churn", baseline, &peak_rss);
+    size_t churn_footprint = eng->footprint();
+    size_t churn_live = LIVE;
+
+    size_t teardown = (size_t) (BLOCK_COUNT * TEARDOWN_SHARE);
+    for (size_t i = 0; i < teardown; i++) {
+        drop(eng);
+        if (++ops % SAMPLE_INTERVAL == 0)
+            sample(eng, ops, "teardown", baseline, &peak_rss);
+    }
+    sample(eng, ops, "teardown", baseline, &peak_rss);
+
+    double seconds = (double) clock() / CLOCKS_PER_SEC - start;
+    printf("# %llu ops in %.1f s of CPU\n", (unsigned long long) ops, seconds);
+    printf("# peak rss %.1f MiB\n", peak_rss / (1024.0 * 1024.0));
+    printf("# after churn: %.1f MiB live, footprint %.1f MiB (%.2fx)\n", churn_live / (1024.0 * 1024.0),
+           churn_footprint / (1024.0 * 1024.0), churn_live ? (double) churn_footprint / churn_live : 0.0);
+    printf("# after teardown: %.1f MiB live, footprint %.1f MiB (%.2fx)\n", LIVE / (1024.0 * 1024.0),
+           eng->footprint() / (1024.0 * 1024.0), LIVE ? (double) eng->footprint() / LIVE : 0.0);
+    return 0;
+}
@@ -0,0 +1,130 @@
+#include "memkernels.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HOT_SET (256 * 1024) /**< Working set the program is assumed to keep in cache */
+#define MIN_BYTES (64 * 1024) /**< Smallest block size benchmarked */
+#define MAX_BYTES (64 * 1024 * 1024) /**< Largest block size benchmarked */
+#define TARGET_BYTES (2ULL * 1024 * 1024 * 1024) /**< Bytes moved per measurement */
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Walk the hot working set and time it
+ *
+ * Run after a copy, this shows how much of the working set the copy evicted.
+ *
+ * @param hot The working set
+ * @return The time the walk took in nanoseconds
+ */
+static double touch_hot(volatile char *hot) {
+    double start = now_ns();
+    for (size_t i = 0; i < HOT_SET; i += 64) {
+        hot[i]++;
+    }
+    return now_ns() - start;
+}
+
+/**
+ * Benchmark copying with one implementation
+ *
+ * @param copy The copy to benchmark, or NULL for memcpy
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param size The block size
+ * @param hot The working set
+ * @param reread Set to the average time to walk the working set after a copy
+ * @return The bandwidth in GB/s
+ */
+static double bench_copy(void (*copy)(void *, const void *, size_t), char *dst, const char *src, size_t size,
+                         char *hot, double *reread) {
+    size_t reps = TARGET_BYTES / size;
+    double copy_time = 0, hot_time = 0;
+    for (size_t r = 0; r < reps; r++) {
+        touch_hot(hot);
+        double start = now_ns();
+        if (copy)
+            copy(dst, src, size);
+        else
+            memcpy(dst, src, size);
+        copy_time += now_ns() - start;
+        hot_time += touch_hot(hot);
+    }
+    *reread = hot_time / reps;
+    return (double) size * reps / copy_time;
+}
+
+/**
+ * Benchmark zeroing with one implementation
+ *
+ * @param zero The zeroing to benchmark, or NULL for memset
+ * @param dst The memory to zero
+ * @param size The block size
+ * @param hot The working set
+ * @param reread Set to the average time to walk the working set after zeroing
+ * @return The bandwidth in GB/s
+ */
+static double bench_zero(void (*zero)(void *, size_t), char *dst, size_t size, char *hot, double *reread) {
+    size_t reps = TARGET_BYTES / size;
+    double zero_time = 0, hot_time = 0;
+    for (size_t r = 0; r < reps; r++) {
+        touch_hot(hot);
+        double start = now_ns();
+        if (zero)
+            zero(dst, size);
+        else
+            memset(dst, 0, size);
+        zero_time += now_ns() - start;
+        hot_time += touch_hot(hot);
+    }
+    *reread = hot_time / reps;
+    return (double) size * reps / zero_time;
+}
+
+/**
+ * Compare the allocator's copy and zero kernels with libc
+ */
+int main(void) {
+    char *src = malloc(MAX_BYTES);
+    char *dst = malloc(MAX_BYTES);
+    char *hot = malloc(HOT_SET);
+    if (src == NULL || dst == NULL || hot == NULL) {
+        printf("Failed to allocate memory\n");
+        return 1;
+    }
+    memset(src, 1, MAX_BYTES);
+    memset(dst, 2, MAX_BYTES);
+    memset(hot, 3, HOT_SET);
+
+    printf("non-temporal threshold: %d bytes\n", TU_NT_THRESHOLD);
+    printf("%-6s %10s %12s %12s %14s %14s\n", "op", "bytes", "libc GB/s", "tu GB/s", "libc reread ns", "tu reread ns");
+    for (size_t size = MIN_BYTES; size <= MAX_BYTES; size *= 4) {
+        double libc_reread, tu_reread;
+        double libc_bw = bench_copy(NULL, dst, src, size, hot, &libc_reread);
+        double tu_bw = bench_copy(tu_copy, dst, src, size, hot, &tu_reread);
+        printf("%-6s %10zu %12.2f %12.2f %14.0f %14.0f\n", "copy", size, libc_bw, tu_bw, libc_reread, tu_reread);
+    }
+    for (size_t size = MIN_BYTES; size <= MAX_BYTES; size *= 4) {
+        double libc_reread, tu_reread;
+        double libc_bw = bench_zero(NULL, dst, size, hot, &libc_reread);
+        double tu_bw = bench_zero(tu_zero, dst, size, hot, &tu_reread);
+        printf("%-6s %10zu %12.2f %12.2f %14.0f %14.0f\n", "zero", size, libc_bw, tu_bw, libc_reread, tu_reread);
+    }
+
+    free(src);
+    free(dst);
+    free(hot);
+    return 0;
+}
@@ -0,0 +1,481 @@
+#include "alloc.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define LARSON_SLOTS 1000 /**< Blocks each larson thread holds */
+#define LARSON_MIN 8 /**< Smallest larson block */
+#define LARSON_MAX 1000 /**< Largest larson block */
+#define LARSON_GENERATION 10000 /**< Replacements a larson thread makes before handing its blocks on */
+#define LARSON_SECONDS 2.0 /**< How long larson runs */
+
+#define THREADTEST_ROUNDS 50 /**< Times each threadtest thread fills and empties its batch */
+#define THREADTEST_OBJECTS 10000 /**< Blocks in a threadtest batch */
+#define THREADTEST_SIZE 64 /**< Size of a threadtest block */
+
+#define XMALLOC_BATCHES 20000 /**< Batches each xmalloc thread allocates */
+#define XMALLOC_BATCH 64 /**< Blocks in an xmalloc batch */
+#define XMALLOC_MIN 16 /**< Smallest xmalloc block */
+#define XMALLOC_MAX 512 /**< Largest xmalloc block */
+
+#define SCRATCH_ITERATIONS 1000 /**< Blocks each cache-scratch thread allocates in turn */
+#define SCRATCH_WRITES 5000 /**< Writes to each cache-scratch block */
+#define SCRATCH_SIZE 8 /**< Size of a cache-scratch block */
+
+/*
+ * Ports of the classic multithreaded allocator benchmarks, run on tumalloc and
+ * the libc allocator at 1, 2, 4, ... threads up to the number of cores:
+ *
+ *     tumalloc_mt_bench [BENCH] [--max-threads N]
+ *
+ *     larson         Threads replace random blocks of random sizes, and every
+ *                    LARSON_GENERATION replacements pass their blocks on to the
+ *                    next thread, as larson's server threads hand over their
+ *                    clients, so most blocks are freed by a thread other than
+ *                    the one that allocated them. Runs for LARSON_SECONDS; an
+ *                    op is a free and a malloc.
+ *     threadtest     Each thread repeatedly allocates a batch of same-sized
+ *                    blocks and frees them all. An op is a malloc or a free.
+ *     xmalloc        Each thread allocates batches of blocks and hands them to
+ *                    the next thread, freeing the batches handed to it, so every
+ *                    block is freed by another thread as between producers and
+ *                    consumers. An op is a malloc or a free.
+ *     cache-scratch  The main thread allocates one small block per thread, side
+ *                    by side, and each thread frees its block, then allocates,
+ *                    writes and frees same-sized blocks. An allocator that hands
+ *                    a thread back the block it freed there shares cache lines
+ *                    between the threads. An op is a write.
+ *
+ * Every run forks a child, so each starts from a fresh allocator and its peak
+ * resident set size, read from wait4, is its own. Each thread does the same
+ * work however many threads there are, so a perfectly scaling allocator's ops
+ * per second grow with the thread count. Configure with
+ * -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+ */
+
+/**
+ * An allocator to benchmark
+ */
+typedef struct engine {
+    const char *name; /**< Name in the report */
+    void *(*malloc)(size_t size); /**< Allocate */
+    void (*free)(void *ptr); /**< Free */
+} engine;
+
+/**
+ * What one benchmark thread works with
+ */
+typedef struct worker {
+    const engine *eng; /**< The allocator */
+    unsigned index; /**< The thread's number, from 0 */
+    unsigned threads; /**< How many threads run */
+    uint64_t ops; /**< Set to the ops the thread made */
+    void *block; /**< The block cache-scratch hands the thread */
+} worker;
+
+/**
+ * A benchmark
+ */
+typedef struct benchmark {
+    const char *name; /**< Name in the report and on the command line */
+    void *(*thread)(void *arg); /**< Body of each thread, taking its worker */
+    void (*setup)(worker *workers, unsigned threads); /**< Prepares shared state before the threads start, or NULL */
+} benchmark;
+
+/**
+ * A batch of xmalloc blocks on its way to the thread that frees it
+ */
+typedef struct xmalloc_batch {
+    struct xmalloc_batch *next; /**< The next batch in the same inbox */
+    void *blocks[XMALLOC_BATCH]; /**< The blocks */
+} xmalloc_batch;
+
+/**
+ * Batches waiting for one xmalloc thread to free them
+ */
+typedef struct xmalloc_inbox {
+    pthread_mutex_t lock; /**< Guards head */
+    xmalloc_batch *head; /**< The batches, newest first */
+} xmalloc_inbox;
+
+static pthread_barrier_t START; /**< Holds the threads until all are ready, then starts the clock */
+static pthread_barrier_t GENERATION; /**< Holds larson threads until all have finished a generation */
+static volatile unsigned STOP; /**< One more than larson's last generation, or 0 until its time is up */
+static double START_NS; /**< When the threads were let go */
+static void **LARSON_BLOCKS; /**< Each larson thread's slots, LARSON_SLOTS apiece */
+static xmalloc_inbox *XMALLOC_INBOXES; /**< Each xmalloc thread's inbox */
+
+/**
+ * Allocate from tumalloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *tu_engine_malloc(size_t size) {
+    return tumalloc(size);
+}
+
+/**
+ * Free a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ */
+static void tu_engine_free(void *ptr) {
+    tufree(ptr);
+}
+
+static const engine ENGINES[] = { /**< The allocators compared, the baseline first */
+    { "libc", malloc, free },
+    { "tumalloc", tu_engine_malloc, tu_engine_free },
+};
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Draw the next number from a xorshift generator
+ *
+ * @param state The generator's state, never 0
+ * @return A random 64-bit number
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * Allocate a block and write to it, exiting if the allocator fails
+ *
+ * @param eng The allocator
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *use(const engine *eng, size_t size) {
+    char *ptr = eng->malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s failed to allocate %zu bytes\n", eng->name, size);
+        exit(1);
+    }
+    ptr[0] = 1;
+    return ptr;
+}
+
+/**
+ * Fill every larson thread's slots, then run the generations
+ *
+ * @param arg The thread's worker
+ * @return NULL
+ */
+static void *larson_thread(void *arg) {
+    worker *w = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15u * (w->index + 1);
+    void **mine = LARSON_BLOCKS + (size_t) w->index * LARSON_SLOTS;
+    for (size_t i = 0; i < LARSON_SLOTS; i++) {
+        mine[i] = use(w->eng, LARSON_MIN + next_random(&rng) % (LARSON_MAX - LARSON_MIN + 1));
+    }
+    pthread_barrier_wait(&START);
+
+    for (unsigned generation = 0;; generation++) {
+        // Work on the slots of the thread generation places ahead, which allocated most of them
+        void **slots = LARSON_BLOCKS + (size_t) ((w->index + generation) % w->threads) * LARSON_SLOTS;
+        for (size_t i = 0; i < LARSON_GENERATION; i++) {
+            size_t slot = next_random(&rng) % LARSON_SLOTS;
+            w->eng->free(slots[slot]);
+            slots[slot] = use(w->eng, LARSON_MIN + next_random(&rng) % (LARSON_MAX - LARSON_MIN + 1));
+        }
+        w->ops += LARSON_GENERATION;
+
+        // The first thread calls time before the barrier and names the generation it ends,
+        // so a thread that reads STOP late, after the next one has begun, still agrees
+        if (w->index == 0 && now_ns() - START_NS >= LARSON_SECONDS * 1e9)
+            STOP = generation + 1;
+        pthread_barrier_wait(&GENERATION);
+        if (STOP == generation + 1)
+            break;
+    }
+    return NULL;
+}
+
+/**
+ * Make room for every larson thread's slots
+ *
+ * @param workers The threads' workers
+ * @param threads How many threads run
+ */
+static void larson_setup(worker *workers, unsigned threads) {
+    (void) workers;
+    STOP = 0;
+    LARSON_BLOCKS = calloc((size_t) threads * LARSON_SLOTS, sizeof(void *));
+    pthread_barrier_init(&GENERATION, NULL, threads);
+}
+
+/**
+ * Allocate and free batches of blocks of one size
+ *
+ * @param arg The thread's worker
+ * @return NULL
+ */
+static void *threadtest_thread(void *arg) {
+    worker *w = arg;
+    void **blocks = malloc(THREADTEST_OBJECTS * sizeof(void *));
+    pthread_barrier_wait(&START);
+
+    for (size_t round = 0; round < THREADTEST_ROUNDS; round++) {
+        for (size_t i = 0; i < THREADTEST_OBJECTS; i++) {
+            blocks[i] = use(w->eng, THREADTEST_SIZE);
+        }
+        for (size_t i = 0; i < THREADTEST_OBJECTS; i++) {
+            w->eng->free(blocks[i]);
+        }
+    }
+    w->ops = 2 * (uint64_t) THREADTEST_ROUNDS * THREADTEST_OBJECTS;
+    free(blocks);
+    return NULL;
+}
+
+/**
+ * Allocate batches for the next thread and free the batches handed over
+ *
+ * @param arg The thread's worker
+ * @return NULL
+ */
+static void *xmalloc_thread(void *arg) {
+    worker *w = arg;
+    uint64_t rng = 0x9e3779b97f4a7c15u * (w->index + 1);
+    xmalloc_inbox *next = &XMALLOC_INBOXES[(w->index + 1) % w->threads];
+    xmalloc_inbox *mine = &XMALLOC_INBOXES[w->index];
+    pthread_barrier_wait(&START);
+
+    for (size_t b = 0; b < XMALLOC_BATCHES; b++) {
+        xmalloc_batch *batch = use(w->eng, sizeof(xmalloc_batch));
+        for (size_t i = 0; i < XMALLOC_BATCH; i++) {
+            batch->blocks[i] = use(w->eng, XMALLOC_MIN + next_random(&rng) % (XMALLOC_MAX - XMALLOC_MIN + 1));
+        }
+        w->ops += XMALLOC_BATCH + 1;
+
+        pthread_mutex_lock(&next->lock);
+        batch->next = next->head;
+        next->head = batch;
+        pthread_mutex_unlock(&next->lock);
+
+        // Take the whole inbox at once and free it outside the lock
+        pthread_mutex_lock(&mine->lock);
+        batch = mine->head;
+        mine->head = NULL;
+        pthread_mutex_unlock(&mine->lock);
+        while (batch != NULL) {
+            xmalloc_batch *after = batch->next;
+            for (size_t i = 0; i < XMALLOC_BATCH; i++) {
+                w->eng->free(batch->blocks[i]);
+            }
+            w->eng->free(batch);
+            w->ops += XMALLOC_BATCH + 1;
+            batch = after;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Set up an empty inbox for each xmalloc thread
+ *
+ * @param workers The threads' workers
+ * @param threads How many threads run
+ */
+static void xmalloc_setup(worker *workers, unsigned threads) {
+    (void) workers;
+    XMALLOC_INBOXES = calloc(threads, sizeof(xmalloc_inbox));
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_mutex_init(&XMALLOC_INBOXES[t].lock, NULL);
+    }
+}
+
+/**
+ * Free the block the main thread handed over, then allocate, write and free blocks of its size
+ *
+ * @param arg The thread's worker
+ * @return NULL
+ */
+static void *scratch_thread(void *arg) {
+    worker *w = arg;
+    pthread_barrier_wait(&START);
+
+    w->eng->free(w->block);
+    for (size_t i = 0; i < SCRATCH_ITERATIONS; i++) {
+        volatile char *block = use(w->eng, SCRATCH_SIZE);
+        for (size_t j = 0; j < SCRATCH_WRITES; j++) {
+            for (size_t k = 0; k < SCRATCH_SIZE; k++) {
+                block[k]++;
+            }
+        }
+        w->eng->free((void *) block);
+    }
+    w->ops = (uint64_t) SCRATCH_ITERATIONS * SCRATCH_WRITES * SCRATCH_SIZE;
+    return NULL;
+}
+
+/**
+ * Allocate one small block per thread from the main thread, so they sit side by side
+ *
+ * @param workers The threads' workers
+ * @param threads How many threads run
+ */
+static void scratch_setup(worker *workers, unsigned threads) {
+    for (unsigned t = 0; t < threads; t++) {
+        workers[t].block = use(workers[t].eng, SCRATCH_SIZE);
+    }
+}
+
+static const benchmark BENCHMARKS[] = { /**< Every benchmark, in report order */
+    { "larson", larson_thread, larson_setup },
+    { "threadtest", threadtest_thread, NULL },
+    { "xmalloc", xmalloc_thread, xmalloc_setup },
+    { "cache-scratch", scratch_thread, scratch_setup },
+};
+
+/**
+ * Run a benchmark in this process and write its ops per second to a pipe
+ *
+ * @param bench The benchmark
+ * @param eng The allocator
+ * @param threads How many threads to run
+ * @param out The pipe
+ * @return The exit status for the child
+ */
+static int run_child(const benchmark *bench, const engine *eng, unsigned threads, int out) {
+    worker *workers = calloc(threads, sizeof(worker));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (workers == NULL || ids == NULL)
+        return 1;
+    for (unsigned t = 0; t < threads; t++) {
+        workers[t].eng = eng;
+        workers[t].index = t;
+        workers[t].threads = threads;
+    }
+    if (bench->setup)
+        bench->setup(workers, threads);
+
+    // The main thread joins the barrier too, so the clock starts once every thread is ready;
+    // the clock is read before the barrier, so the threads see START_NS
+    pthread_barrier_init(&START, NULL, threads + 1);
+    for (unsigned t = 0; t < threads; t++) {
+        if (pthread_create(&ids[t], NULL, bench->thread, &workers[t]) != 0)
+            return 1;
+    }
+    START_NS = now_ns();
+    pthread_barrier_wait(&START);
+
+    uint64_t ops = 0;
+    for (unsigned t = 0; t < threads; t++) {
+        pthread_join(ids[t], NULL);
+        ops += workers[t].ops;
+    }
+    double rate = ops / ((now_ns() - START_NS) / 1e9);
+    return write(out, &rate, sizeof(rate)) == sizeof(rate) ? 0 : 1;
+}
+
+/**
+ * Run a benchmark in a child process
+ *
+ * @param bench The benchmark
+ * @param eng The allocator
+ * @param threads How many threads to run
+ * @param rate Set to the ops per second
+ * @param rss Set to the child's peak resident set size in bytes
+ * @return 0 on success, -1 if the run failed
+ */
+static int run(const benchmark *bench, const engine *eng, unsigned threads, double *rate, double *rss) {
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(run_child(bench, eng, threads, fds[1]));
+    }
+
+    close(fds[1]);
+    ssize_t got = read(fds[0], rate, sizeof(*rate));
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        got != sizeof(*rate))
+        return -1;
+    *rss = usage.ru_maxrss * 1024.0;
+    return 0;
+}
+
+/**
+ * Run every benchmark, or the one named, on each allocator across thread counts
+ */
+int main(int argc, char **argv) {
+    const char *only = NULL;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned max_threads = cores > 0 ? (unsigned) cores : 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-threads") == 0 && i + 1 < argc) {
+            max_threads = (unsigned) strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] != '-') {
+            only = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [larson|threadtest|xmalloc|cache-scratch] [--max-threads N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads == 0)
+        max_threads = 1;
+    size_t engines = sizeof(ENGINES) / sizeof(ENGINES[0]);
+
+    printf("%-14s %7s", "benchmark", "threads");
+    for (size_t e = 0; e < engines; e++) {
+        char header[2][32];
+        snprintf(header[0], sizeof(header[0]), "%s Mops/s", ENGINES[e].name);
+        snprintf(header[1], sizeof(header[1]), "%s RSS MiB", ENGINES[e].name);
+        printf(" %16s %16s", header[0], header[1]);
+    }
+    printf("\n");
+
+    for (size_t b = 0; b < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); b++) {
+        if (only && strcmp(only, BENCHMARKS[b].name) != 0)
+            continue;
+        // Powers of two, then the core count itself if it is not one
+        for (unsigned threads = 1;; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+            printf("%-14s %7u", BENCHMARKS[b].name, threads);
+            for (size_t e = 0; e < engines; e++) {
+                double rate, rss;
+                if (run(&BENCHMARKS[b], &ENGINES[e], threads, &rate, &rss) != 0)
+                    printf(" %16s %16s", "failed", "-");
+                else
+                    printf(" %16.2f %16.1f", rate / 1e6, rss / (1024.0 * 1024.0));
+            }
+            printf("\n");
+            if (threads == max_threads)
+                break;
+        }
+    }
+    return 0;
+}
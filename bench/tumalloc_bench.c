@@ -0,0 +1,720 @@
+#include "alloc.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SIZE_COUNT (1 << 16) /**< Sizes drawn for each distribution, reused round robin */
+#define PAIR_OPS (1 << 20) /**< Allocations made by each malloc/free pair case */
+#define BATCH 4096 /**< Blocks held at once by the LIFO, FIFO and random order cases */
+#define BATCH_ROUNDS 64 /**< Times each of those cases fills and empties its batch */
+#define CHAIN_ROUNDS 256 /**< Growth chains run by each realloc case */
+#define CALLOC_BYTES (1ULL << 30) /**< Bytes allocated by each large calloc case, in blocks of its size */
+#define REPEATS 3 /**< Runs of each case, of which the fastest is reported */
+
+#define FIXED_SIZE 64 /**< Size of every request in the fixed distribution */
+#define UNIFORM_MAX 1024 /**< Largest size of the uniform distribution, which starts at 1 */
+#define POWER_MIN 16 /**< Smallest size of the power-law distribution */
+#define POWER_MAX 65536 /**< Largest size of the power-law distribution */
+#define POWER_ALPHA 1.0 /**< Tail exponent of the power-law distribution */
+
+#define LATENCY_SUB_BITS 7 /**< Each power of two of latency is split into 2^(this - 1) buckets, within 1.6% */
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) << (LATENCY_SUB_BITS - 1)) /**< Buckets covering any 64-bit latency */
+#define CALIBRATE_NS 50000000 /**< Nanoseconds the timestamp counter is measured against the clock for */
+
+/*
+ * Microbenchmarks of tumalloc against the libc allocator in the same process:
+ *
+ *     tumalloc_bench [--latency] [FILTER]     (only cases whose name contains FILTER)
+ *
+ * Each case is run REPEATS times on each allocator and the fastest run is kept,
+ * reported as nanoseconds per call, where every malloc, calloc, realloc and free
+ * counts as one call. The sizes and free orders are drawn before the clock
+ * starts, from a fixed seed, so both allocators see the same requests. Blocks
+ * have a byte written to them, so neither allocator gets away with handing out
+ * memory it never has to back.
+ *
+ * tumalloc is called through the same macros a program uses, so its fast paths
+ * are inlined into the engine's wrappers; both allocators pay the same indirect
+ * call to reach those. Configure with -DCMAKE_BUILD_TYPE=Release, or tumalloc is
+ * measured unoptimized against an optimized libc.
+ *
+ * With --latency, each case instead runs once more on each allocator with every
+ * call timed on its own, by rdtsc and rdtscp fenced with lfence where the CPU has
+ * them and by the monotonic clock elsewhere. The times go into a log-linear
+ * histogram per kind of call, as HdrHistogram keeps them, and the report gives
+ * their 50th, 99th and 99.9th percentiles and maximum in nanoseconds: the
+ * occasional slow path a mean hides. The cost of the timer itself, which every
+ * figure includes, is printed first.
+ */
+
+/**
+ * An allocator to benchmark
+ */
+typedef struct engine {
+    const char *name; /**< Name in the report */
+    void *(*malloc)(size_t size); /**< Allocate */
+    void *(*calloc)(size_t num, size_t size); /**< Allocate zeroed */
+    void *(*realloc)(void *ptr, size_t size); /**< Resize */
+    void (*free)(void *ptr); /**< Free */
+} engine;
+
+/**
+ * One benchmark
+ */
+typedef struct bench_case {
+    const char *name; /**< Name in the report */
+    size_t (*run)(const engine *eng, const size_t *sizes); /**< Runs it once, returning how many calls it made */
+    const size_t *sizes; /**< The size distribution it draws from, or NULL if it makes its own */
+} bench_case;
+
+/**
+ * Kinds of call timed apart in latency mode
+ */
+enum latency_op {
+    LATENCY_MALLOC, /**< malloc */
+    LATENCY_CALLOC, /**< calloc */
+    LATENCY_REALLOC, /**< realloc */
+    LATENCY_FREE, /**< free */
+    LATENCY_OPS, /**< Number of kinds */
+};
+
+/**
+ * Counts of latencies in log-linear buckets
+ */
+typedef struct latency_histogram {
+    uint64_t counts[LATENCY_BUCKETS]; /**< Calls whose latency fell in each bucket */
+    uint64_t total; /**< Calls recorded */
+    uint64_t max; /**< The longest latency recorded */
+} latency_histogram;
+
+static size_t FIXED_SIZES[SIZE_COUNT]; /**< The fixed distribution */
+static size_t UNIFORM_SIZES[SIZE_COUNT]; /**< The uniform distribution */
+static size_t POWER_SIZES[SIZE_COUNT]; /**< The power-law distribution */
+static unsigned RANDOM_ORDER[BATCH]; /**< The order the random order cases free their batch in */
+static void *BLOCKS[BATCH]; /**< The batch held by the LIFO, FIFO and random order cases */
+static uint64_t RNG_STATE = 0x9e3779b97f4a7c15u; /**< State of the generator the sizes are drawn from */
+static const engine *TIMED; /**< The allocator the timed engine passes calls on to */
+static latency_histogram LATENCIES[LATENCY_OPS]; /**< Latencies of the calls the timed engine has made, in ticks */
+static double TICKS_PER_NS = 1; /**< Timer ticks in a nanosecond */
+static const char *const LATENCY_NAMES[LATENCY_OPS] = { "malloc", "calloc", "realloc", "free" }; /**< Names in the report */
+
+/**
+ * Allocate from tumalloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *tu_engine_malloc(size_t size) {
+    return tumalloc(size);
+}
+
+/**
+ * Allocate zeroed memory from tumalloc
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the block
+ */
+static void *tu_engine_calloc(size_t num, size_t size) {
+    return tucalloc(num, size);
+}
+
+/**
+ * Resize a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ * @param size The new size
+ * @return A pointer to the resized block
+ */
+static void *tu_engine_realloc(void *ptr, size_t size) {
+    return turealloc(ptr, size);
+}
+
+/**
+ * Free a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ */
+static void tu_engine_free(void *ptr) {
+    tufree(ptr);
+}
+
+static const engine ENGINES[] = { /**< The allocators compared, the baseline first */
+    { "libc", malloc, calloc, realloc, free },
+    { "tumalloc", tu_engine_malloc, tu_engine_calloc, tu_engine_realloc, tu_engine_free },
+};
+
+/**
+ * Make a block look used, so the compiler cannot drop an allocation that is never read
+ *
+ * @param ptr The block
+ */
+static inline void escape(void *ptr) {
+    __asm__ volatile("" : : "r"(ptr) : "memory");
+}
+
+/**
+ * Allocate a block and write to it
+ *
+ * @param eng The allocator
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static inline void *use(const engine *eng, size_t size) {
+    char *ptr = eng->malloc(size);
+    if (ptr == NULL) {
+        fprintf(stderr, "%s failed to allocate %zu bytes\n", eng->name, size);
+        exit(1);
+    }
+    ptr[0] = 1;
+    escape(ptr);
+    return ptr;
+}
+
+/**
+ * Draw the next number from a xorshift generator
+ *
+ * @return A random 64-bit number
+ */
+static uint64_t next_random(void) {
+    RNG_STATE ^= RNG_STATE << 13;
+    RNG_STATE ^= RNG_STATE >> 7;
+    RNG_STATE ^= RNG_STATE << 17;
+    return RNG_STATE;
+}
+
+/**
+ * Draw the sizes of every distribution and the random free order
+ */
+static void draw_inputs(void) {
+    // Inverse of the bounded Pareto distribution's CDF, which most requests land low in
+    double low = pow(POWER_MIN, POWER_ALPHA), high = pow(POWER_MAX, POWER_ALPHA);
+    for (size_t i = 0; i < SIZE_COUNT; i++) {
+        FIXED_SIZES[i] = FIXED_SIZE;
+        UNIFORM_SIZES[i] = 1 + next_random() % UNIFORM_MAX;
+        double u = (double) (next_random() >> 11) / (double) (1ULL << 53);
+        double size = pow(-(u * high - u * low - high) / (high * low), -1.0 / POWER_ALPHA);
+        POWER_SIZES[i] = size < POWER_MIN ? POWER_MIN : size > POWER_MAX ? POWER_MAX : (size_t) size;
+    }
+
+    // Fisher-Yates shuffle of the batch's indexes
+    for (unsigned i = 0; i < BATCH; i++) {
+        RANDOM_ORDER[i] = i;
+    }
+    for (unsigned i = BATCH - 1; i > 0; i--) {
+        unsigned j = next_random() % (i + 1);
+        unsigned tmp = RANDOM_ORDER[i];
+        RANDOM_ORDER[i] = RANDOM_ORDER[j];
+        RANDOM_ORDER[j] = tmp;
+    }
+}
+
+/**
+ * Free every block as soon as it is allocated
+ *
+ * @param eng The allocator
+ * @param sizes The sizes to ask for
+ * @return The number of calls made
+ */
+static size_t run_pairs(const engine *eng, const size_t *sizes) {
+    for (size_t i = 0; i < PAIR_OPS; i++) {
+        eng->free(use(eng, sizes[i % SIZE_COUNT]));
+    }
+    return 2 * (size_t) PAIR_OPS;
+}
+
+/**
+ * Fill a batch, then free it newest first
+ *
+ * @param eng The allocator
+ * @param sizes The sizes to ask for
+ * @return The number of calls made
+ */
+static size_t run_lifo(const engine *eng, const size_t *sizes) {
+    size_t next = 0;
+    for (size_t round = 0; round < BATCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BATCH; i++) {
+            BLOCKS[i] = use(eng, sizes[next++ % SIZE_COUNT]);
+        }
+        for (size_t i = BATCH; i > 0; i--) {
+            eng->free(BLOCKS[i - 1]);
+        }
+    }
+    return 2 * (size_t) BATCH * BATCH_ROUNDS;
+}
+
+/**
+ * Fill a batch, then free it oldest first
+ *
+ * @param eng The allocator
+ * @param sizes The sizes to ask for
+ * @return The number of calls made
+ */
+static size_t run_fifo(const engine *eng, const size_t *sizes) {
+    size_t next = 0;
+    for (size_t round = 0; round < BATCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BATCH; i++) {
+            BLOCKS[i] = use(eng, sizes[next++ % SIZE_COUNT]);
+        }
+        for (size_t i = 0; i < BATCH; i++) {
+            eng->free(BLOCKS[i]);
+        }
+    }
+    return 2 * (size_t) BATCH * BATCH_ROUNDS;
+}
+
+/**
+ * Fill a batch, then free it in a shuffled order
+ *
+ * @param eng The allocator
+ * @param sizes The sizes to ask for
+ * @return The number of calls made
+ */
+static size_t run_random(const engine *eng, const size_t *sizes) {
+    size_t next = 0;
+    for (size_t round = 0; round < BATCH_ROUNDS; round++) {
+        for (size_t i = 0; i < BATCH; i++) {
+            BLOCKS[i] = use(eng, sizes[next++ % SIZE_COUNT]);
+        }
+        for (size_t i = 0; i < BATCH; i++) {
+            eng->free(BLOCKS[RANDOM_ORDER[i]]);
+        }
+    }
+    return 2 * (size_t) BATCH * BATCH_ROUNDS;
+}
+
+/**
+ * Grow a block through realloc, from first to last, by step bytes or by doubling
+ *
+ * @param eng The allocator
+ * @param first The size to start at
+ * @param last The size to stop at
+ * @param step Bytes added each step, or 0 to double
+ * @return The number of calls made
+ */
+static size_t run_chain(const engine *eng, size_t first, size_t last, size_t step) {
+    size_t calls = 0;
+    for (size_t round = 0; round < CHAIN_ROUNDS; round++) {
+        char *ptr = use(eng, first);
+        for (size_t size = first; size < last;) {
+            size = step ? size + step : 2 * size;
+            ptr = eng->realloc(ptr, size);
+            if (ptr == NULL) {
+                fprintf(stderr, "%s failed to reallocate to %zu bytes\n", eng->name, size);
+                exit(1);
+            }
+            ptr[size - 1] = 1;
+            escape(ptr);
+            calls++;
+        }
+        eng->free(ptr);
+        calls += 2;
+    }
+    return calls;
+}
+
+/**
+ * Grow blocks from 16 bytes to 256 KiB by doubling
+ *
+ * @param eng The allocator
+ * @param sizes Unused
+ * @return The number of calls made
+ */
+static size_t run_realloc_double(const engine *eng, const size_t *sizes) {
+    (void) sizes;
+    return run_chain(eng, 16, 256 * 1024, 0);
+}
+
+/**
+ * Grow blocks from 16 bytes to 16 KiB, 64 bytes at a time
+ *
+ * @param eng The allocator
+ * @param sizes Unused
+ * @return The number of calls made
+ */
+static size_t run_realloc_step(const engine *eng, const size_t *sizes) {
+    (void) sizes;
+    return run_chain(eng, 16, 16 * 1024, 64);
+}
+
+/**
+ * Allocate zeroed blocks of one large size and free them
+ *
+ * @param eng The allocator
+ * @param size The size of each block
+ * @return The number of calls made
+ */
+static size_t run_calloc(const engine *eng, size_t size) {
+    size_t count = CALLOC_BYTES / size;
+    for (size_t i = 0; i < count; i++) {
+        char *ptr = eng->calloc(1, size);
+        if (ptr == NULL) {
+            fprintf(stderr, "%s failed to allocate %zu zeroed bytes\n", eng->name, size);
+            exit(1);
+        }
+        ptr[size / 2] = 1;
+        escape(ptr);
+        eng->free(ptr);
+    }
+    return 2 * count;
+}
+
+/**
+ * Allocate zeroed 64 KiB blocks
+ *
+ * @param eng The allocator
+ * @param sizes Unused
+ * @return The number of calls made
+ */
+static size_t run_calloc_64k(const engine *eng, const size_t *sizes) {
+    (void) sizes;
+    return run_calloc(eng, 64 * 1024);
+}
+
+/**
+ * Allocate zeroed 1 MiB blocks
+ *
+ * @param eng The allocator
+ * @param sizes Unused
+ * @return The number of calls made
+ */
+static size_t run_calloc_1m(const engine *eng, const size_t *sizes) {
+    (void) sizes;
+    return run_calloc(eng, 1024 * 1024);
+}
+
+/**
+ * Allocate zeroed 16 MiB blocks
+ *
+ * @param eng The allocator
+ * @param sizes Unused
+ * @return The number of calls made
+ */
+static size_t run_calloc_16m(const engine *eng, const size_t *sizes) {
+    (void) sizes;
+    return run_calloc(eng, 16 * 1024 * 1024);
+}
+
+static const bench_case CASES[] = { /**< Every benchmark, in report order */
+    { "pair/fixed", run_pairs, FIXED_SIZES },
+    { "pair/uniform", run_pairs, UNIFORM_SIZES },
+    { "pair/power", run_pairs, POWER_SIZES },
+    { "lifo/fixed", run_lifo, FIXED_SIZES },
+    { "lifo/uniform", run_lifo, UNIFORM_SIZES },
+    { "lifo/power", run_lifo, POWER_SIZES },
+    { "fifo/fixed", run_fifo, FIXED_SIZES },
+    { "fifo/uniform", run_fifo, UNIFORM_SIZES },
+    { "fifo/power", run_fifo, POWER_SIZES },
+    { "random/fixed", run_random, FIXED_SIZES },
+    { "random/uniform", run_random, UNIFORM_SIZES },
+    { "random/power", run_random, POWER_SIZES },
+    { "realloc/double", run_realloc_double, NULL },
+    { "realloc/step", run_realloc_step, NULL },
+    { "calloc/64k", run_calloc_64k, NULL },
+    { "calloc/1m", run_calloc_1m, NULL },
+    { "calloc/16m", run_calloc_16m, NULL },
+};
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The current time in nanoseconds
+ */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Time a case on one allocator
+ *
+ * @param bench The case
+ * @param eng The allocator
+ * @return The fastest run's nanoseconds per call
+ */
+static double time_case(const bench_case *bench, const engine *eng) {
+    // An untimed run first, so the allocator has its memory and caches set up
+    bench->run(eng, bench->sizes);
+    double best = 0;
+    for (int r = 0; r < REPEATS; r++) {
+        double start = now_ns();
+        size_t calls = bench->run(eng, bench->sizes);
+        double per_call = (now_ns() - start) / (double) calls;
+        if (r == 0 || per_call < best)
+            best = per_call;
+    }
+    return best;
+}
+
+/**
+ * Read the timer before a timed call, once earlier instructions have finished
+ *
+ * @return The time in ticks
+ */
+static inline uint64_t timer_start(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    uint64_t ticks = __rdtsc();
+    _mm_lfence();
+    return ticks;
+#else
+    return (uint64_t) now_ns();
+#endif
+}
+
+/**
+ * Read the timer after a timed call, once it has finished and before later instructions start
+ *
+ * @return The time in ticks
+ */
+static inline uint64_t timer_stop(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned aux;
+    uint64_t ticks = __rdtscp(&aux);
+    _mm_lfence();
+    return ticks;
+#else
+    return (uint64_t) now_ns();
+#endif
+}
+
+/**
+ * Measure how many timer ticks pass in a nanosecond
+ */
+static void calibrate_timer(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    double start_ns = now_ns();
+    uint64_t start = timer_start();
+    while (now_ns() - start_ns < CALIBRATE_NS) {
+    }
+    TICKS_PER_NS = (double) (timer_stop() - start) / (now_ns() - start_ns);
+#endif
+}
+
+/**
+ * Find the bucket a latency is counted in
+ *
+ * Below 2^LATENCY_SUB_BITS every value has a bucket of its own; above, each
+ * power of two is split into 2^(LATENCY_SUB_BITS - 1) buckets by the bits
+ * below its top one.
+ *
+ * @param value The latency
+ * @return The bucket's index
+ */
+static size_t latency_bucket(uint64_t value) {
+    unsigned bits = value ? 64 - (unsigned) __builtin_clzll(value) : 0;
+    if (bits <= LATENCY_SUB_BITS)
+        return (size_t) value;
+    unsigned shift = bits - LATENCY_SUB_BITS;
+    return ((size_t) shift << (LATENCY_SUB_BITS - 1)) + (size_t) (value >> shift);
+}
+
+/**
+ * Find the highest latency a bucket counts
+ *
+ * @param bucket The bucket's index
+ * @return The latency
+ */
+static uint64_t latency_bucket_top(size_t bucket) {
+    if (bucket < ((size_t) 1 << LATENCY_SUB_BITS))
+        return bucket;
+    unsigned shift = (unsigned) (bucket >> (LATENCY_SUB_BITS - 1)) - 1;
+    uint64_t top = bucket - ((size_t) shift << (LATENCY_SUB_BITS - 1));
+    return ((top + 1) << shift) - 1;
+}
+
+/**
+ * Count a latency
+ *
+ * @param histogram The histogram
+ * @param value The latency
+ */
+static inline void latency_record(latency_histogram *histogram, uint64_t value) {
+    histogram->counts[latency_bucket(value)]++;
+    histogram->total++;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/**
+ * Find a percentile of the latencies counted
+ *
+ * @param histogram The histogram, not empty
+ * @param percentile The percentile, from 0 to 100
+ * @return The highest latency of the bucket the percentile falls in, or the maximum if lower
+ */
+static uint64_t latency_percentile(const latency_histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t) ceil(percentile / 100 * (double) histogram->total);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += histogram->counts[b];
+        if (seen >= rank) {
+            uint64_t top = latency_bucket_top(b);
+            return top < histogram->max ? top : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Allocate from the timed allocator, timing the call
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *timed_malloc(size_t size) {
+    uint64_t start = timer_start();
+    void *ptr = TIMED->malloc(size);
+    latency_record(&LATENCIES[LATENCY_MALLOC], timer_stop() - start);
+    return ptr;
+}
+
+/**
+ * Allocate zeroed memory from the timed allocator, timing the call
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the block
+ */
+static void *timed_calloc(size_t num, size_t size) {
+    uint64_t start = timer_start();
+    void *ptr = TIMED->calloc(num, size);
+    latency_record(&LATENCIES[LATENCY_CALLOC], timer_stop() - start);
+    return ptr;
+}
+
+/**
+ * Resize a block of the timed allocator, timing the call
+ *
+ * @param ptr The block, or NULL
+ * @param size The new size
+ * @return A pointer to the resized block
+ */
+static void *timed_realloc(void *ptr, size_t size) {
+    uint64_t start = timer_start();
+    ptr = TIMED->realloc(ptr, size);
+    latency_record(&LATENCIES[LATENCY_REALLOC], timer_stop() - start);
+    return ptr;
+}
+
+/**
+ * Free a block of the timed allocator, timing the call
+ *
+ * @param ptr The block, or NULL
+ */
+static void timed_free(void *ptr) {
+    uint64_t start = timer_start();
+    TIMED->free(ptr);
+    latency_record(&LATENCIES[LATENCY_FREE], timer_stop() - start);
+}
+
+static const engine TIMED_ENGINE = { "timed", timed_malloc, timed_calloc, timed_realloc, timed_free }; /**< Times each call to TIMED */
+
+/**
+ * Print the latency report's header, with the timer's own cost
+ */
+static void print_latency_header(void) {
+    // Time nothing, to show what every latency includes
+    latency_histogram empty = { 0 };
+    for (int i = 0; i < 100000; i++) {
+        uint64_t start = timer_start();
+        latency_record(&empty, timer_stop() - start);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    printf("timer: rdtsc, %.3f ticks/ns", TICKS_PER_NS);
+#else
+    printf("timer: clock_gettime");
+#endif
+    printf(", overhead p50 %.1f ns, p99 %.1f ns\n", latency_percentile(&empty, 50) / TICKS_PER_NS,
+           latency_percentile(&empty, 99) / TICKS_PER_NS);
+    printf("%-16s %-9s %-8s %10s %10s %10s %10s %12s\n", "case", "engine", "call", "count", "p50 ns", "p99 ns",
+           "p99.9 ns", "max ns");
+}
+
+/**
+ * Time every call of a case on one allocator and print its percentiles
+ *
+ * @param bench The case
+ * @param eng The allocator
+ */
+static void latency_case(const bench_case *bench, const engine *eng) {
+    // An untimed run first, so the allocator has its memory and caches set up
+    bench->run(eng, bench->sizes);
+    TIMED = eng;
+    memset(LATENCIES, 0, sizeof(LATENCIES));
+    bench->run(&TIMED_ENGINE, bench->sizes);
+
+    for (int op = 0; op < LATENCY_OPS; op++) {
+        const latency_histogram *histogram = &LATENCIES[op];
+        if (histogram->total == 0)
+            continue;
+        printf("%-16s %-9s %-8s %10llu %10.1f %10.1f %10.1f %12.1f\n", bench->name, eng->name, LATENCY_NAMES[op],
+               (unsigned long long) histogram->total, latency_percentile(histogram, 50) / TICKS_PER_NS,
+               latency_percentile(histogram, 99) / TICKS_PER_NS, latency_percentile(histogram, 99.9) / TICKS_PER_NS,
+               histogram->max / TICKS_PER_NS);
+    }
+    fflush(stdout);
+}
+
+/**
+ * Run every case, or those matching a filter, on each allocator and compare their speed or latency
+ */
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    int latency = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--latency") == 0)
+            latency = 1;
+        else
+            filter = argv[i];
+    }
+    size_t engines = sizeof(ENGINES) / sizeof(ENGINES[0]);
+    draw_inputs();
+
+    if (latency) {
+        calibrate_timer();
+        print_latency_header();
+        for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); c++) {
+            if (filter && strstr(CASES[c].name, filter) == NULL)
+                continue;
+            for (size_t e = 0; e < engines; e++) {
+                latency_case(&CASES[c], &ENGINES[e]);
+            }
+        }
+        return 0;
+    }
+
+    printf("%-16s", "case");
+    for (size_t e = 0; e < engines; e++) {
+        char header[32];
+        snprintf(header, sizeof(header), "%s ns/op", ENGINES[e].name);
+        printf(" %14s", header);
+    }
+    printf(" %10s\n", "speedup");
+
+    for (size_t c = 0; c < sizeof(CASES) / sizeof(CASES[0]); c++) {
+        if (filter && strstr(CASES[c].name, filter) == NULL)
+            continue;
+        double times[sizeof(ENGINES) / sizeof(ENGINES[0])];
+        printf("%-16s", CASES[c].name);
+        for (size_t e = 0; e < engines; e++) {
+            times[e] = time_case(&CASES[c], &ENGINES[e]);
+            printf(" %14.2f", times[e]);
+        }
+        // How many times faster tumalloc is than the libc baseline
+        printf(" %9.2fx\n", times[0] / times[engines - 1]);
+        fflush(stdout);
+    }
+    return 0;
+}
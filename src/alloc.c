@@ -1,217 +1,1859 @@
+#define TU_TRACE_INTERNAL /* Calls within the allocator are not traced */
+
 #include "alloc.h"
+#include "memkernels.h"
+#include "output.h"
+#include "pagemap.h"
+#include "pages.h"
+#include "profile.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#endif
+
+
+#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+#define MAGIC TU_MAGIC /**< Magic number stored in the header of every allocated block */
+#define ALIGNED_MAGIC 0x76543210 /**< Magic number in the header in front of a block moved up for alignment */
+#define SAMPLED_MAGIC 0x5a3b1c0d /**< Magic number in the header of a block sampled by the heap profiler */
+#define GRANULE_SHIFT 4 /**< log2 of ALIGNMENT; free block sizes are stored in units of ALIGNMENT */
+#define INDEX_MIN_CAPACITY 256 /**< Number of descriptors the free index starts with */
+#define RELEASE_THRESHOLD (64 * 1024) /**< Freed blocks at least this big give their pages back to the OS, eventually */
+#define PURGE_THRESHOLD (4 * 1024 * 1024) /**< Bytes of such blocks freed before their pages are given back */
+#define PURGE_RANGES (PURGE_THRESHOLD / RELEASE_THRESHOLD) /**< Most freed blocks waiting for their pages to be given back */
+#define NO_BLOCK ((size_t) -1) /**< Slot returned when no free block matches */
+#define SKIP_LEVELS 16 /**< Levels of the skip list over the free index; enough for billions of blocks */
+#define SKIP_NIL UINT32_MAX /**< Skip list link that points nowhere */
+#define INDEX_SLOT_BYTES (sizeof(free_ref) + sizeof(uint32_t) + sizeof(uint8_t) + 2 * SKIP_LEVELS * sizeof(uint32_t)) /**< Bytes the free index maps per descriptor */
+#define FIT_SCAN_MAX 128 /**< Free indexes up to this many blocks are searched by a vector scan instead of the skip list */
+#define LAST_REMAINDER_MAX 512 /**< Blocks up to this size, header included, are carved from the last remainder */
+#define MAX_GRANULES ((size_t) UINT32_MAX) /**< Largest block the free index can describe, in granules */
+#define TOP_GROW_MIN (128 * 1024) /**< The top chunk grows by at least this much at a time */
+#define TOP_TRIM_THRESHOLD (512 * 1024) /**< A free top chunk bigger than this is given back to the OS */
+#define TOP_PAD (128 * 1024) /**< Bytes of top chunk kept when trimming */
+#define LARGE_THRESHOLD (128 * 1024) /**< Blocks at least this big, header included, get their own run of pages */
+#define HEAP_CLASSES 64 /**< Number of free lists in a private heap, one per 16-byte size */
+#define HEAP_SMALL_MAX (HEAP_CLASSES * ALIGNMENT) /**< Biggest block a private heap carves from its chunks */
+#define HEAP_CHUNK_PAGES 16 /**< Pages in each chunk a private heap carves small blocks from */
+#define CACHE_LIMIT 64 /**< Most free blocks a thread caches per size class */
+#define CACHE_CLASS_BYTES (64 * 1024) /**< Bytes of blocks a thread caches per size class, for the bigger classes */
+#define CACHE_BATCH_BYTES (8 * 1024) /**< Roughly how many bytes of blocks a cache miss takes from the heap */
+#define BOOTSTRAP_SIZE (64 * 1024) /**< Bytes of static memory for allocations made while the heap is locked */
+
+_Static_assert(sizeof(header) % ALIGNMENT == 0, "header must keep payloads aligned");
+_Static_assert((1 << GRANULE_SHIFT) == ALIGNMENT, "granules must match the alignment");
+
+#ifdef TU_COMPRESSED_LINKS
+/*
+ * With compressed links the free index stores where each block starts as a 32-bit
+ * count of granules from the base of the heap instead of a full pointer. That
+ * halves the address array, lets the fit kernels compare twice as many addresses
+ * per instruction, and limits the heap to 64 GiB above its base.
+ */
+typedef uint32_t free_ref; /**< Start of a free block, in granules from HEAP_BASE */
+
+static char *HEAP_BASE = NULL; /**< First byte of the heap; compressed starts count from here */
+
+/**
+ * Compress a heap address
+ *
+ * @param ptr The address, inside the heap
+ * @return The address as a free index reference
+ */
+static inline free_ref to_ref(const char *ptr) {
+    return (free_ref) ((size_t) (ptr - HEAP_BASE) >> GRANULE_SHIFT);
+}
+
+/**
+ * Expand a free index reference
+ *
+ * @param ref The reference
+ * @return The heap address it stands for
+ */
+static inline char *from_ref(free_ref ref) {
+    return HEAP_BASE + ((size_t) ref << GRANULE_SHIFT);
+}
+#else
+typedef char *free_ref; /**< Start of a free block */
+
+/**
+ * Turn a heap address into a free index reference
+ *
+ * @param ptr The address
+ * @return The address as a free index reference
+ */
+static inline free_ref to_ref(const char *ptr) {
+    return (free_ref) ptr;
+}
+
+/**
+ * Turn a free index reference back into a heap address
+ *
+ * @param ref The reference
+ * @return The heap address it stands for
+ */
+static inline char *from_ref(free_ref ref) {
+    return ref;
+}
+#endif
+
+/*
+ * The free index is a structure of arrays: block sizes are packed into their own
+ * array so that a fit search compares many candidates per vector instruction,
+ * and the start addresses sit in a parallel array that is only read on a hit.
+ *
+ * The slots themselves are in no particular order. Address order is kept by a
+ * skip list threaded through the slots, with one array of 32-bit slot numbers
+ * per level, so inserting a block and finding its neighbors both take O(log n)
+ * and never touch the heap. Each link also records the largest block among
+ * those it passes over, from its own slot up to the one it points at, so the
+ * lowest block that fits a request is found in O(log n) as well, by skipping
+ * every link whose blocks are all too small.
+ */
+static uint32_t *FREE_SIZES = NULL; /**< Sizes of the free blocks, in granules */
+static free_ref *FREE_STARTS = NULL; /**< Start addresses of the free blocks, parallel to FREE_SIZES */
+static uint8_t *FREE_HEIGHTS = NULL; /**< Number of skip list levels each free block is linked into */
+static uint32_t *FREE_LINKS = NULL; /**< Skip list links; level l of slot i is at l * FREE_CAPACITY + i */
+static uint32_t *FREE_SPAN_MAX = NULL; /**< Largest size, in granules, of the blocks each link passes over; parallel to FREE_LINKS */
+static uint32_t SKIP_HEAD[SKIP_LEVELS]; /**< First slot on each skip list level, valid below SKIP_HEIGHT */
+static uint32_t SKIP_HEAD_MAX[SKIP_LEVELS]; /**< Largest size, in granules, of the blocks before SKIP_HEAD on each level */
+static size_t SKIP_HEIGHT = 0; /**< Number of skip list levels in use */
+static uint32_t SKIP_SEED = 0x9e3779b9; /**< State of the generator that picks skip list heights */
+static size_t FREE_COUNT = 0; /**< Number of descriptor slots ever used in the free index, holes included */
+static uint32_t FREE_HOLES = SKIP_NIL; /**< Stack of unused slots below FREE_COUNT, linked through their bottom level */
+static size_t FREE_CAPACITY = 0; /**< Number of descriptors the free index has room for */
+
+/*
+ * The last remainder is the rest of the free block most recently split for a small
+ * request. It stays out of the free index, so consecutive small requests are carved
+ * from it in address order with a pointer bump instead of a search.
+ */
+static char *LAST_REMAINDER = NULL; /**< First byte of the last remainder */
+static size_t LAST_REMAINDER_SIZE = 0; /**< Size of the last remainder, zero when there is none */
+
+/*
+ * Big freed blocks keep their pages until PURGE_THRESHOLD bytes of them have piled
+ * up, so a block that is freed and allocated again right away never faults. The
+ * purge then gives back whatever of those blocks is still free.
+ */
+static char *DIRTY_STARTS[PURGE_RANGES]; /**< First byte of each big block freed since the last purge */
+static size_t DIRTY_SIZES[PURGE_RANGES]; /**< Size of each big block freed since the last purge */
+static size_t DIRTY_COUNT = 0; /**< Number of big blocks freed since the last purge */
+static size_t DIRTY_BYTES = 0; /**< Bytes of big blocks freed since the last purge */
+
+/*
+ * The top chunk is the free memory at the very end of the heap, up to the program
+ * break. It is never put in the free index: requests nothing else can serve are
+ * split off its front, and when it runs short the break is moved to grow it in
+ * place, so growing the heap never strands a fragment at the end.
+ */
+static char *TOP = NULL; /**< First byte of the top chunk; the top chunk ends at the program break */
+static size_t TOP_SIZE = 0; /**< Size of the top chunk */
+static size_t HEAP_BYTES = 0; /**< Bytes the heap has taken from the break and not given back */
+
+static tu_span HEAP_SPAN = { .kind = TU_SPAN_HEAP }; /**< Span every page of the sbrk heap maps to */
+static uint64_t LARGE_ALLOCS = 0; /**< Large blocks allocated so far */
+static uint64_t LARGE_FREES = 0; /**< Large blocks freed so far */
+
+/*
+ * An allocation made from inside the allocator, by pthread_atfork or by a failing
+ * assertion, finds the allocator lock already held by its own thread; rather than
+ * deadlocking it is served from a static bootstrap arena that is never reused.
+ */
+static char BOOTSTRAP[BOOTSTRAP_SIZE] __attribute__((aligned(ALIGNMENT))); /**< Memory for reentrant allocations */
+static size_t BOOTSTRAP_USED = 0; /**< Bytes of BOOTSTRAP handed out */
+
+/**
+ * Report a fatal error and abort
+ *
+ * The message is written straight to the file descriptor, since stdio may need
+ * to allocate and its buffer would be lost by the abort anyway.
+ *
+ * @param message The message, ending in a newline
+ */
+static void fail(const char *message) {
+    ssize_t unused = write(STDOUT_FILENO, message, strlen(message));
+    (void) unused;
+    abort();
+}
+
+/**
+ * Get the page size of the system
+ *
+ * @return The page size in bytes
+ */
+static size_t page_size(void) {
+    static size_t size = 0;
+    if (size == 0) {
+        size = (size_t) sysconf(_SC_PAGESIZE);
+    }
+    return size;
+}
+
+/**
+ * Grow the free index so it can hold at least one more descriptor
+ *
+ * The index is mapped on its own pages rather than carved out of the heap,
+ * so that scanning it stays within a few contiguous cache lines.
+ *
+ * @return 0 on success, -1 if no memory could be mapped
+ */
+static int grow_index(void) {
+    size_t capacity = FREE_CAPACITY ? FREE_CAPACITY * 2 : INDEX_MIN_CAPACITY;
+    size_t slot_bytes = INDEX_SLOT_BYTES;
+
+    // Skip list links are 32-bit slot numbers
+    if (capacity > SKIP_NIL) {
+        return -1;
+    }
+
+    free_ref *starts = mmap(NULL, capacity * slot_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (starts == MAP_FAILED) {
+        return -1;
+    }
+    uint32_t *links = (uint32_t *) (starts + capacity);
+    uint32_t *span_max = links + SKIP_LEVELS * capacity;
+    uint32_t *sizes = span_max + SKIP_LEVELS * capacity;
+    uint8_t *heights = (uint8_t *) (sizes + capacity);
+
+    // Move the existing descriptors over and drop the old mapping
+    if (FREE_STARTS != NULL) {
+        memcpy(starts, FREE_STARTS, FREE_COUNT * sizeof(free_ref));
+        memcpy(sizes, FREE_SIZES, FREE_COUNT * sizeof(uint32_t));
+        memcpy(heights, FREE_HEIGHTS, FREE_COUNT * sizeof(uint8_t));
+        for (size_t level = 0; level < SKIP_LEVELS; level++) {
+            memcpy(links + level * capacity, FREE_LINKS + level * FREE_CAPACITY, FREE_COUNT * sizeof(uint32_t));
+            memcpy(span_max + level * capacity, FREE_SPAN_MAX + level * FREE_CAPACITY, FREE_COUNT * sizeof(uint32_t));
+        }
+        munmap(FREE_STARTS, FREE_CAPACITY * slot_bytes);
+    }
+    FREE_STARTS = starts;
+    FREE_SIZES = sizes;
+    FREE_HEIGHTS = heights;
+    FREE_LINKS = links;
+    FREE_SPAN_MAX = span_max;
+    FREE_CAPACITY = capacity;
+    return 0;
+}
+
+/**
+ * Get the skip list link of a slot at a level
+ *
+ * @param slot The slot, or SKIP_NIL for the head of the list
+ * @param level The level
+ * @return A pointer to the link
+ */
+static uint32_t *skip_link(uint32_t slot, size_t level) {
+    return slot == SKIP_NIL ? &SKIP_HEAD[level] : &FREE_LINKS[level * FREE_CAPACITY + slot];
+}
+
+/**
+ * Get the largest size a slot's link passes over at a level
+ *
+ * @param slot The slot, or SKIP_NIL for the head of the list
+ * @param level The level
+ * @return A pointer to the size, in granules
+ */
+static uint32_t *skip_span_max(uint32_t slot, size_t level) {
+    return slot == SKIP_NIL ? &SKIP_HEAD_MAX[level] : &FREE_SPAN_MAX[level * FREE_CAPACITY + slot];
+}
+
+/**
+ * Recompute the largest size a slot's link passes over at a level, from the level below
+ *
+ * @param slot The slot, or SKIP_NIL for the head of the list
+ * @param level The level
+ * @return Non-zero if the size changed
+ */
+static int skip_recompute(uint32_t slot, size_t level) {
+    uint32_t largest = 0;
+    if (level == 0) {
+        largest = slot == SKIP_NIL ? 0 : FREE_SIZES[slot];
+    } else {
+        // The link covers the links below it from this slot up to where it points, about four of them
+        uint32_t end = *skip_link(slot, level);
+        largest = *skip_span_max(slot, level - 1);
+        for (uint32_t next = *skip_link(slot, level - 1); next != end; next = *skip_link(next, level - 1)) {
+            if (FREE_SPAN_MAX[(level - 1) * FREE_CAPACITY + next] > largest)
+                largest = FREE_SPAN_MAX[(level - 1) * FREE_CAPACITY + next];
+        }
+    }
+    uint32_t *stored = skip_span_max(slot, level);
+    if (*stored == largest)
+        return 0;
+    *stored = largest;
+    return 1;
+}
+
+/**
+ * Bring the largest sizes up to date after a block was linked, unlinked or resized
+ *
+ * Above the levels whose links changed, a level whose largest sizes come out the
+ * same leaves every level above it the same too, so the update usually stops
+ * after a level or two.
+ *
+ * @param before The last slot below the block on each level, from skip_search
+ * @param slot The block if it is still linked, or SKIP_NIL
+ * @param relinked The number of levels the block was linked into or unlinked from, 0 if it was only resized
+ */
+static void skip_refresh(const uint32_t before[SKIP_LEVELS], uint32_t slot, size_t relinked) {
+    // Bottom up, so each level is recomputed from an up to date level below
+    for (size_t level = 0; level < SKIP_HEIGHT; level++) {
+        int changed = skip_recompute(before[level], level);
+        if (slot != SKIP_NIL && level < FREE_HEIGHTS[slot])
+            changed |= skip_recompute(slot, level);
+        if (!changed && level >= relinked)
+            return;
+    }
+}
+
+/**
+ * Find, on every level, the last block that starts below an address
+ *
+ * @param addr The address to search for, as a free index reference
+ * @param before Filled with the last slot below addr on each level, SKIP_NIL meaning the head
+ * @return The last slot below addr on the bottom level, SKIP_NIL if there is none
+ */
+static uint32_t skip_search(free_ref addr, uint32_t before[SKIP_LEVELS]) {
+    uint32_t slot = SKIP_NIL;
+    for (size_t level = SKIP_HEIGHT; level-- > 0;) {
+        uint32_t next = *skip_link(slot, level);
+        while (next != SKIP_NIL && FREE_STARTS[next] < addr) {
+            slot = next;
+            next = *skip_link(slot, level);
+        }
+        before[level] = slot;
+    }
+    return slot;
+}
+
+/**
+ * Pick the height of a new skip list node, each level a quarter as likely as the one below
+ *
+ * @return The height
+ */
+static size_t skip_height(void) {
+    // xorshift32 is plenty for balancing a skip list
+    SKIP_SEED ^= SKIP_SEED << 13;
+    SKIP_SEED ^= SKIP_SEED >> 17;
+    SKIP_SEED ^= SKIP_SEED << 5;
+    size_t height = 1 + (size_t) __builtin_ctz(SKIP_SEED | (1u << (2 * (SKIP_LEVELS - 1)))) / 2;
+    return height;
+}
+
+/**
+ * Link a block into the free index next to the blocks found by a search for its start
+ *
+ * @param start The first byte of the free block
+ * @param size The size of the free block
+ * @param before The last slot below start on each level, from skip_search; refreshed here
+ * @return 0 on success, -1 if the index could not grow
+ */
+static int link_free_block(char *start, size_t size, uint32_t before[SKIP_LEVELS]) {
+    // Reuse a hole left by a removed block before taking a fresh slot
+    uint32_t slot = FREE_HOLES;
+    if (slot != SKIP_NIL) {
+        FREE_HOLES = *skip_link(slot, 0);
+    } else {
+        if (FREE_COUNT == FREE_CAPACITY && grow_index() != 0) {
+            return -1;
+        }
+        slot = (uint32_t) FREE_COUNT++;
+    }
+    FREE_STARTS[slot] = to_ref(start);
+    FREE_SIZES[slot] = (uint32_t) (size >> GRANULE_SHIFT);
+
+    // Link the block in after the last block below it on each of its levels
+    size_t height = skip_height();
+    while (SKIP_HEIGHT < height) {
+        before[SKIP_HEIGHT] = SKIP_NIL;
+        SKIP_HEAD[SKIP_HEIGHT++] = SKIP_NIL;
+    }
+    for (size_t level = 0; level < height; level++) {
+        uint32_t *link = skip_link(before[level], level);
+        *skip_link(slot, level) = *link;
+        *link = slot;
+    }
+    FREE_HEIGHTS[slot] = (uint8_t) height;
+    skip_refresh(before, slot, height);
+    return 0;
+}
+
+/**
+ * Add a block to the free index
+ *
+ * @param start The first byte of the free block
+ * @param size The size of the free block
+ * @return 0 on success, -1 if the index could not grow
+ */
+static int insert_free_block(char *start, size_t size) {
+    uint32_t before[SKIP_LEVELS];
+    skip_search(to_ref(start), before);
+    return link_free_block(start, size, before);
+}
+
+/**
+ * Unlink a block from the free index without refreshing the largest sizes
+ *
+ * The slot becomes a hole with a size of zero, which no search can match, so
+ * removal never moves another descriptor.
+ *
+ * @param slot The slot of the block to unlink
+ * @param before The last slot below the block on each level, from skip_search
+ */
+static void unlink_free_block(uint32_t slot, const uint32_t before[SKIP_LEVELS]) {
+    for (size_t level = 0; level < FREE_HEIGHTS[slot]; level++) {
+        *skip_link(before[level], level) = *skip_link(slot, level);
+    }
+    FREE_SIZES[slot] = 0;
+    *skip_link(slot, 0) = FREE_HOLES;
+    FREE_HOLES = slot;
+}
+
+/**
+ * Remove a block from the free index
+ *
+ * @param slot The slot of the block to remove
+ */
+static void remove_free_block(size_t slot) {
+    uint32_t before[SKIP_LEVELS];
+    skip_search(FREE_STARTS[slot], before);
+    unlink_free_block((uint32_t) slot, before);
+    skip_refresh(before, SKIP_NIL, FREE_HEIGHTS[slot]);
+}
+
+/**
+ * Split a free block into two blocks
+ *
+ * The front of the block is handed out and the descriptor shrinks to cover the rest.
+ * Every size is a multiple of ALIGNMENT and the header lives out of line, so any
+ * remainder is a valid free block on its own.
+ *
+ * @param slot The slot of the block to split
+ * @param size The size of the first new split block
+ * @return A pointer to the first block
+ */
+static void *split(size_t slot, size_t size) {
+    char *start = from_ref(FREE_STARTS[slot]);
+    uint32_t granules = (uint32_t) (size >> GRANULE_SHIFT);
+
+    // Use up the whole block if nothing would remain
+    if (FREE_SIZES[slot] == granules) {
+        remove_free_block(slot);
+        return start;
+    }
+
+    // The block keeps its place in address order, but the links over it may have lost their largest block
+    uint32_t before[SKIP_LEVELS];
+    FREE_STARTS[slot] = to_ref(start + size);
+    FREE_SIZES[slot] -= granules;
+    skip_search(FREE_STARTS[slot], before);
+    skip_refresh(before, (uint32_t) slot, 0);
+    return start;
+}
+
+/**
+ * Give back the pages of a range that lie fully inside free blocks in the index
+ *
+ * Parts of the range that were allocated again, or went to the last remainder or
+ * the top chunk, are left alone.
+ *
+ * @param start The first byte of the range
+ * @param size The size of the range
+ */
+static void purge_range(char *start, size_t size) {
+    uintptr_t mask = page_size() - 1;
+    char *end = start + size;
+
+    // Start from the last free block that starts at or below the range
+    uint32_t before[SKIP_LEVELS];
+    uint32_t slot = skip_search(to_ref(start + ALIGNMENT), before);
+    if (slot == SKIP_NIL)
+        slot = SKIP_HEIGHT != 0 ? SKIP_HEAD[0] : SKIP_NIL;
+
+    for (; slot != SKIP_NIL && from_ref(FREE_STARTS[slot]) < end; slot = *skip_link(slot, 0)) {
+        char *block = from_ref(FREE_STARTS[slot]);
+        char *block_end = block + ((size_t) FREE_SIZES[slot] << GRANULE_SHIFT);
+        uintptr_t lo = ((uintptr_t) (block > start ? block : start) + mask) & ~mask;
+        uintptr_t hi = (uintptr_t) (block_end < end ? block_end : end) & ~mask;
+        if (lo < hi) {
+            madvise((void *) lo, hi - lo, MADV_DONTNEED);
+        }
+    }
+}
+
+/**
+ * Note a freed block whose pages should go back to the OS, and give them back once enough pile up
+ *
+ * @param block The freed block
+ * @param size The size of the freed block
+ */
+static void release_pages(char *block, size_t size) {
+    if (size < RELEASE_THRESHOLD) {
+        return;
+    }
+    DIRTY_STARTS[DIRTY_COUNT] = block;
+    DIRTY_SIZES[DIRTY_COUNT] = size;
+    DIRTY_COUNT++;
+    DIRTY_BYTES += size;
+    if (DIRTY_BYTES < PURGE_THRESHOLD && DIRTY_COUNT < PURGE_RANGES) {
+        return;
+    }
+
+    for (size_t i = 0; i < DIRTY_COUNT; i++) {
+        purge_range(DIRTY_STARTS[i], DIRTY_SIZES[i]);
+    }
+    DIRTY_COUNT = 0;
+    DIRTY_BYTES = 0;
+}
+
+/**
+ * Give the end of a large free top chunk back to the OS
+ */
+static void trim_top(void) {
+    if (TOP_SIZE <= TOP_TRIM_THRESHOLD) {
+        return;
+    }
+
+    // Only shrink the break if nobody else has moved it since the top chunk last grew
+    if ((char *) sbrk(0) != TOP + TOP_SIZE) {
+        return;
+    }
+
+    size_t trim = (TOP_SIZE - TOP_PAD) & ~(page_size() - 1);
+    if (trim != 0 && sbrk(-(intptr_t) trim) != (void *)-1) {
+        TOP_SIZE -= trim;
+        HEAP_BYTES -= trim;
+        // Forget the pages that are now wholly past the break
+        uintptr_t first = ((uintptr_t) (TOP + TOP_SIZE) + TU_PAGE_SIZE - 1) >> TU_PAGE_SHIFT;
+        uintptr_t end = ((uintptr_t) (TOP + TOP_SIZE + trim) + TU_PAGE_SIZE - 1) >> TU_PAGE_SHIFT;
+        tu_pagemap_set((void *) (first << TU_PAGE_SHIFT), end - first, NULL);
+    }
+}
+
+/**
+ * Coalesce neighboring free blocks
+ *
+ * Neighbors are found through the free index, so the freed pages are never read.
+ * One search finds both neighbors and the links around them; a block that merges
+ * into an indexed neighbor grows that descriptor in place. A merge that would
+ * overflow a 32-bit granule count is skipped.
+ *
+ * @param start The first byte of the freed block
+ * @param size The size of the freed block
+ */
+static void coalesce(char *start, size_t size) {
+    char *free_start = start;
+    char *free_end = start + size;
+
+    // The blocks right below and right above the freed one are its only possible free neighbors
+    uint32_t before[SKIP_LEVELS];
+    uint32_t below = skip_search(to_ref(start), before);
+    uint32_t above = SKIP_HEIGHT != 0 ? *skip_link(below, 0) : SKIP_NIL;
+
+    // Merge with the next block if it starts where this one ends
+    uint32_t next = SKIP_NIL;
+    if (above != SKIP_NIL && from_ref(FREE_STARTS[above]) == free_end
+            && FREE_SIZES[above] <= MAX_GRANULES - (size >> GRANULE_SHIFT)) {
+        next = above;
+        free_end += (size_t) FREE_SIZES[next] << GRANULE_SHIFT;
+    }
+
+    // Merge with the previous block if it ends where this one starts
+    uint32_t prev = SKIP_NIL;
+    if (below != SKIP_NIL && from_ref(FREE_STARTS[below]) + ((size_t) FREE_SIZES[below] << GRANULE_SHIFT) == start
+            && FREE_SIZES[below] <= MAX_GRANULES - ((size_t) (free_end - free_start) >> GRANULE_SHIFT)) {
+        prev = below;
+        free_start = from_ref(FREE_STARTS[prev]);
+    }
+
+    // Merge with the last remainder if they touch
+    int remainder = 0;
+    if (LAST_REMAINDER_SIZE != 0 && LAST_REMAINDER + LAST_REMAINDER_SIZE == free_start) {
+        free_start = LAST_REMAINDER;
+        remainder = 1;
+    } else if (LAST_REMAINDER_SIZE != 0 && free_end == LAST_REMAINDER) {
+        free_end = LAST_REMAINDER + LAST_REMAINDER_SIZE;
+        remainder = 1;
+    }
+
+    int top = TOP != NULL && free_end == TOP;
+    if (top || remainder) {
+        // The merged block leaves the index, so both neighbors go; next first, while the search still holds
+        if (next != SKIP_NIL) {
+            unlink_free_block(next, before);
+            skip_refresh(before, SKIP_NIL, FREE_HEIGHTS[next]);
+        }
+        if (prev != SKIP_NIL)
+            remove_free_block(prev);
+    }
+
+    if (top) {
+        // The block ends at the top chunk, so the top chunk swallows it (and the last remainder with it)
+        if (remainder)
+            LAST_REMAINDER_SIZE = 0;
+        TOP_SIZE += TOP - free_start;
+        TOP = free_start;
+        trim_top();
+    } else if (remainder) {
+        // Otherwise the last remainder keeps growing in place
+        LAST_REMAINDER = free_start;
+        LAST_REMAINDER_SIZE = free_end - free_start;
+    } else if (prev != SKIP_NIL) {
+        // The previous block keeps its place in address order and grows over this one and the next
+        size_t relinked = 0;
+        if (next != SKIP_NIL) {
+            unlink_free_block(next, before);
+            relinked = FREE_HEIGHTS[next];
+        }
+        FREE_SIZES[prev] = (uint32_t) ((size_t) (free_end - free_start) >> GRANULE_SHIFT);
+        skip_refresh(before, prev, relinked);
+    } else if (next != SKIP_NIL) {
+        // Nothing lies between this block and the next, so the next one can start earlier without moving
+        FREE_STARTS[next] = to_ref(free_start);
+        FREE_SIZES[next] = (uint32_t) ((size_t) (free_end - free_start) >> GRANULE_SHIFT);
+        skip_refresh(before, next, 0);
+    } else if (link_free_block(free_start, free_end - free_start, before) != 0) {
+        fail("FREE INDEX EXHAUSTED\n");
+    }
+
+    // Only once the block is in the index can the purge find it
+    release_pages(start, size);
+}
+
+/**
+ * Add a block of any size to the free index, in as many descriptors as it takes
+ *
+ * @param start The first byte of the free block
+ * @param size The size of the free block
+ * @return 0 on success, -1 if the index could not grow
+ */
+static int insert_free_span(char *start, size_t size) {
+    while (size != 0) {
+        size_t piece = size;
+        if ((piece >> GRANULE_SHIFT) > MAX_GRANULES)
+            piece = MAX_GRANULES << GRANULE_SHIFT;
+        if (insert_free_block(start, piece) != 0)
+            return -1;
+        start += piece;
+        size -= piece;
+    }
+    return 0;
+}
+
+/**
+ * Put the last remainder back into the free index
+ *
+ * @return 0 on success, -1 if the index could not grow
+ */
+static int retire_last_remainder(void) {
+    if (insert_free_span(LAST_REMAINDER, LAST_REMAINDER_SIZE) != 0) {
+        return -1;
+    }
+    LAST_REMAINDER_SIZE = 0;
+    return 0;
+}
+
+/**
+ * Carve a block off the front of the last remainder
+ *
+ * @param size The size of the block, header included
+ * @return A pointer to the block or NULL if the last remainder is too small
+ */
+static void *take_last_remainder(size_t size) {
+    if (LAST_REMAINDER_SIZE < size) {
+        return NULL;
+    }
+    char *start = LAST_REMAINDER;
+    LAST_REMAINDER += size;
+    LAST_REMAINDER_SIZE -= size;
+    return start;
+}
+
+/**
+ * Split a free block for a small request and keep the rest as the last remainder
+ *
+ * @param slot The slot of the block to split
+ * @param size The size of the block needed, header included
+ * @return A pointer to the block
+ */
+static void *split_last_remainder(size_t slot, size_t size) {
+    char *start = from_ref(FREE_STARTS[slot]);
+    size_t block_size = (size_t) FREE_SIZES[slot] << GRANULE_SHIFT;
+
+    // Taking the block out first guarantees the old remainder has a slot to go back to
+    remove_free_block(slot);
+    if (retire_last_remainder() != 0) {
+        fail("FREE INDEX EXHAUSTED\n");
+    }
+
+    LAST_REMAINDER = start + size;
+    LAST_REMAINDER_SIZE = block_size - size;
+    return start;
+}
+
+/**
+ * Call sbrk to get memory from the OS
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the allocated memory
+ */
+static void *do_alloc(size_t size) {
+
+    // Ensure that the input size is greater than zero
+    if (size <= 0) return NULL;
+
+    // Ensure the size is a multiple of 16, which is the alignment value.
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+    // The initial break is not guaranteed to be aligned, so pad it once if needed
+    uintptr_t brk = (uintptr_t) sbrk(0);
+    if (brk & (ALIGNMENT - 1)) {
+        if (sbrk(ALIGNMENT - (brk & (ALIGNMENT - 1))) == (void *)-1) {
+            return NULL;
+        }
+    }
+
+    // Use sbrk to allocate more memory according to the size input in the function. sbrk returns the new break address (pointer), which means the address the heap ends at at the bottom and breaks up the end of the heap and start of unallocated memory
+    void *ptr = sbrk(size);
+
+    // Check to see if the allocation suceeded; if not, return null. This call could fail for reasons including that the requested memory exceeds the process's limits, or if there's insufficient memory available on the system.
+    if (ptr == (void *)-1) {
+        return NULL;
+    }
+    // If the allocation did succeed, the code will reach this point and will return the correct pointer
+    return ptr;
+}
+
+/**
+ * Grow the top chunk in place until it can hold a block
+ *
+ * @param size The size of the block the top chunk must hold
+ * @return 0 on success, -1 if the break could not be moved
+ */
+static int extend_top(size_t size) {
+    // If something else moved the break, the old top chunk cannot grow anymore and becomes an ordinary free block
+    if (TOP != NULL && (char *) sbrk(0) != TOP + TOP_SIZE) {
+        if (insert_free_span(TOP, TOP_SIZE) != 0) {
+            return -1;
+        }
+        TOP = NULL;
+        TOP_SIZE = 0;
+    }
+
+    // Grow by a whole number of pages, and by enough that small requests do not each need a system call
+    size_t grow = size - TOP_SIZE;
+    if (grow < TOP_GROW_MIN)
+        grow = TOP_GROW_MIN;
+    grow = (grow + page_size() - 1) & ~(page_size() - 1);
+
+    char *ptr = do_alloc(grow);
+    if (ptr == NULL) {
+        // Close to the limit; try for exactly what is missing
+        grow = size - TOP_SIZE;
+        ptr = do_alloc(grow);
+        if (ptr == NULL) {
+            return -1;
+        }
+    }
+
+#ifdef TU_COMPRESSED_LINKS
+    // Compressed starts can only reach 64 GiB past the first byte of the heap
+    if (HEAP_BASE == NULL)
+        HEAP_BASE = ptr;
+    if (ptr < HEAP_BASE || (size_t) (ptr + grow - HEAP_BASE) >> GRANULE_SHIFT > UINT32_MAX) {
+        sbrk(-(intptr_t) grow);
+        return -1;
+    }
+#endif
+
+    // Map the new pages to the heap span, so tufree recognises the blocks carved from them
+    uintptr_t first = (uintptr_t) ptr >> TU_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) ptr + grow - 1) >> TU_PAGE_SHIFT;
+    if (tu_pagemap_set((void *) (first << TU_PAGE_SHIFT), last - first + 1, &HEAP_SPAN) != 0) {
+        sbrk(-(intptr_t) grow);
+        return -1;
+    }
+
+    // The first growth, or a growth the break had to be realigned for, starts a new top chunk
+    if (TOP == NULL || ptr != TOP + TOP_SIZE) {
+        if (TOP != NULL && insert_free_span(TOP, TOP_SIZE) != 0) {
+            return -1;
+        }
+        TOP = ptr;
+        TOP_SIZE = 0;
+    }
+    TOP_SIZE += grow;
+    HEAP_BYTES += grow;
+    return TOP_SIZE >= size ? 0 : -1;
+}
+
+/**
+ * Split a block off the front of the top chunk, growing it if needed
+ *
+ * @param size The size of the block, header included
+ * @return A pointer to the block or NULL if the heap could not grow
+ */
+static void *take_top(size_t size) {
+    if (TOP_SIZE < size && extend_top(size) != 0) {
+        return NULL;
+    }
+    char *start = TOP;
+    TOP += size;
+    TOP_SIZE -= size;
+    return start;
+}
+
+/*
+ * Placement is address-ordered first fit: of all the blocks that are big enough,
+ * the one at the lowest address is used. Free memory therefore gathers at low
+ * addresses and the high end of the heap drains into the top chunk, where it can
+ * be trimmed. A big index is searched down the skip list, skipping every link
+ * whose largest block is too small. A small one fits in a few cache lines, and
+ * the kernels below scan all of it, keeping the lowest fitting address per
+ * vector lane, faster than chasing links.
+ */
+
+/**
+ * Find the lowest free block that is big enough, one candidate at a time
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+static size_t find_fit_scalar(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    size_t best = NO_BLOCK;
+    for (size_t i = 0; i < count; i++) {
+        if (sizes[i] >= need && (best == NO_BLOCK || starts[i] < starts[best]))
+            best = i;
+    }
+    return best;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#ifndef TU_COMPRESSED_LINKS
+/**
+ * Find the lowest free block that is big enough, four candidates per step
+ *
+ * User-space addresses are below 2^63, so signed 64-bit compares order them correctly.
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+__attribute__((target("avx2")))
+static size_t find_fit_avx2(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    __m256i want = _mm256_set1_epi64x((long long) need - 1);
+    __m256i best = _mm256_set1_epi64x(INT64_MAX);
+    __m256i best_slot = _mm256_set1_epi64x(-1);
+    __m256i slot = _mm256_setr_epi64x(0, 1, 2, 3);
+    __m256i step = _mm256_set1_epi64x(4);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i have = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *) (sizes + i)));
+        __m256i addr = _mm256_loadu_si256((const __m256i *) (starts + i));
+        // A lane improves if its block fits and starts below the best so far
+        __m256i better = _mm256_and_si256(_mm256_cmpgt_epi64(have, want), _mm256_cmpgt_epi64(best, addr));
+        best = _mm256_blendv_epi8(best, addr, better);
+        best_slot = _mm256_blendv_epi8(best_slot, slot, better);
+        slot = _mm256_add_epi64(slot, step);
+    }
+
+    // Reduce the lanes, then finish the tail one at a time
+    int64_t lane_best[4], lane_slot[4];
+    _mm256_storeu_si256((__m256i *) lane_best, best);
+    _mm256_storeu_si256((__m256i *) lane_slot, best_slot);
+    size_t result = NO_BLOCK;
+    for (int lane = 0; lane < 4; lane++) {
+        if (lane_slot[lane] >= 0 && (result == NO_BLOCK || starts[lane_slot[lane]] < starts[result]))
+            result = (size_t) lane_slot[lane];
+    }
+    for (; i < count; i++) {
+        if (sizes[i] >= need && (result == NO_BLOCK || starts[i] < starts[result]))
+            result = i;
+    }
+    return result;
+}
+
+/**
+ * Find the lowest free block that is big enough, eight candidates per step
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+__attribute__((target("avx512f,avx512vl")))
+static size_t find_fit_avx512(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    __m256i want = _mm256_set1_epi32((int) need);
+    __m512i best = _mm512_set1_epi64(INT64_MAX);
+    __m512i best_slot = _mm512_set1_epi64(-1);
+    __m512i slot = _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    __m512i step = _mm512_set1_epi64(8);
+    size_t i = 0;
+    for (; i < count; i += 8) {
+        // The tail is handled by masking off the lanes past the end
+        __mmask8 live = count - i >= 8 ? 0xff : (__mmask8) ((1u << (count - i)) - 1);
+        __m256i have = _mm256_maskz_loadu_epi32(live, sizes + i);
+        __m512i addr = _mm512_maskz_loadu_epi64(live, starts + i);
+        __mmask8 fits = _mm256_mask_cmpge_epu32_mask(live, have, want);
+        __mmask8 better = _mm512_mask_cmplt_epu64_mask(fits, addr, best);
+        best = _mm512_mask_mov_epi64(best, better, addr);
+        best_slot = _mm512_mask_mov_epi64(best_slot, better, slot);
+        slot = _mm512_add_epi64(slot, step);
+    }
+
+    int64_t low = _mm512_reduce_min_epi64(best);
+    if (low == INT64_MAX) {
+        return NO_BLOCK;
+    }
+    __mmask8 at = _mm512_cmpeq_epi64_mask(best, _mm512_set1_epi64(low));
+    int64_t lane_slot[8];
+    _mm512_storeu_si512((void *) lane_slot, best_slot);
+    return (size_t) lane_slot[__builtin_ctz(at)];
+}
+#else
+/**
+ * Find the lowest free block that is big enough, eight candidates per step
+ *
+ * Compressed starts are unsigned 32-bit values; flipping the sign bit lets the
+ * signed compare order them.
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The compressed start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+__attribute__((target("avx2")))
+static size_t find_fit_avx2(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    __m256i want = _mm256_set1_epi32((int) need);
+    __m256i flip = _mm256_set1_epi32(INT32_MIN);
+    __m256i best = _mm256_set1_epi32(INT32_MAX);
+    __m256i none = _mm256_set1_epi32(-1);
+    __m256i best_slot = none;
+    __m256i slot = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step = _mm256_set1_epi32(8);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i have = _mm256_loadu_si256((const __m256i *) (sizes + i));
+        __m256i addr = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (starts + i)), flip);
+        // A lane improves if its block fits and starts below the best so far, or is the lane's first fit
+        __m256i fits = _mm256_cmpeq_epi32(_mm256_max_epu32(have, want), have);
+        __m256i lower = _mm256_or_si256(_mm256_cmpgt_epi32(best, addr), _mm256_cmpeq_epi32(best_slot, none));
+        __m256i better = _mm256_and_si256(fits, lower);
+        best = _mm256_blendv_epi8(best, addr, better);
+        best_slot = _mm256_blendv_epi8(best_slot, slot, better);
+        slot = _mm256_add_epi32(slot, step);
+    }
+
+    // Reduce the lanes, then finish the tail one at a time
+    uint32_t lane_slot[8];
+    _mm256_storeu_si256((__m256i *) lane_slot, best_slot);
+    size_t result = NO_BLOCK;
+    for (int lane = 0; lane < 8; lane++) {
+        if (lane_slot[lane] != UINT32_MAX && (result == NO_BLOCK || starts[lane_slot[lane]] < starts[result]))
+            result = lane_slot[lane];
+    }
+    for (; i < count; i++) {
+        if (sizes[i] >= need && (result == NO_BLOCK || starts[i] < starts[result]))
+            result = i;
+    }
+    return result;
+}
+
+/**
+ * Find the lowest free block that is big enough, sixteen candidates per step
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The compressed start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+__attribute__((target("avx512f")))
+static size_t find_fit_avx512(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    __m512i want = _mm512_set1_epi32((int) need);
+    __m512i best = _mm512_set1_epi32(-1);
+    __m512i best_slot = _mm512_set1_epi32(-1);
+    __m512i slot = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i step = _mm512_set1_epi32(16);
+    __mmask16 found = 0;
+    size_t i = 0;
+    for (; i < count; i += 16) {
+        // The tail is handled by masking off the lanes past the end
+        __mmask16 live = count - i >= 16 ? 0xffff : (__mmask16) ((1u << (count - i)) - 1);
+        __m512i have = _mm512_maskz_loadu_epi32(live, sizes + i);
+        __m512i addr = _mm512_maskz_loadu_epi32(live, starts + i);
+        __mmask16 fits = _mm512_mask_cmpge_epu32_mask(live, have, want);
+        // Lanes that have not found anything yet take any fit, so a start of UINT32_MAX is not lost
+        __mmask16 better = _mm512_mask_cmplt_epu32_mask(fits, addr, best) | (fits & ~found);
+        best = _mm512_mask_mov_epi32(best, better, addr);
+        best_slot = _mm512_mask_mov_epi32(best_slot, better, slot);
+        found |= better;
+        slot = _mm512_add_epi32(slot, step);
+    }
+
+    if (found == 0) {
+        return NO_BLOCK;
+    }
+    uint32_t low = _mm512_mask_reduce_min_epu32(found, best);
+    __mmask16 at = _mm512_mask_cmpeq_epi32_mask(found, best, _mm512_set1_epi32((int) low));
+    uint32_t lane_slot[16];
+    _mm512_storeu_si512((void *) lane_slot, best_slot);
+    return lane_slot[__builtin_ctz(at)];
+}
+#endif
+#endif
+
+static size_t find_fit_resolve(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need);
+
+/** The fit search in use, picked on the first call from what the CPU supports */
+static size_t (*find_fit_kernel)(const uint32_t *, const free_ref *, size_t, uint32_t) = find_fit_resolve;
+
+/**
+ * Pick the widest fit search the CPU supports, then run it
+ *
+ * @param sizes The sizes of the free blocks, in granules
+ * @param starts The start addresses of the free blocks
+ * @param count The number of free blocks
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+static size_t find_fit_resolve(const uint32_t *sizes, const free_ref *starts, size_t count, uint32_t need) {
+    find_fit_kernel = find_fit_scalar;
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl"))
+        find_fit_kernel = find_fit_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        find_fit_kernel = find_fit_avx2;
+#endif
+    return find_fit_kernel(sizes, starts, count, need);
+}
+
+/**
+ * Find the lowest free block that is big enough by walking the skip list
+ *
+ * @param need The size needed, in granules
+ * @return The slot of the lowest block that fits or NO_BLOCK
+ */
+static size_t find_fit_skip(uint32_t need) {
+    // Move right past every link that holds no fit, then drop a level; the first fit is below the link reached
+    uint32_t slot = SKIP_NIL;
+    for (size_t level = SKIP_HEIGHT; level-- > 0;) {
+        while (*skip_span_max(slot, level) < need) {
+            slot = *skip_link(slot, level);
+            if (slot == SKIP_NIL)
+                return NO_BLOCK;
+        }
+    }
+    return slot == SKIP_NIL ? NO_BLOCK : slot;
+}
+
+/**
+ * Find the lowest free block that is big enough
+ *
+ * @param size The size of the block needed, header included
+ * @return The slot of the block or NO_BLOCK if none fits
+ */
+static size_t find_fit(size_t size) {
+    uint32_t need = (uint32_t) (size >> GRANULE_SHIFT);
+    if (FREE_COUNT <= FIT_SCAN_MAX)
+        return find_fit_kernel(FREE_SIZES, FREE_STARTS, FREE_COUNT, need);
+    return find_fit_skip(need);
+}
+
+/**
+ * Allocate from the bootstrap arena
+ *
+ * Used when the allocator is reentered by the thread holding its lock. The
+ * blocks carry a normal header, so they can be reallocated and asked about,
+ * but freeing them does nothing.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL if the arena is used up
+ */
+static void *bootstrap_alloc(size_t size) {
+    size_t payload = size ? (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1) : ALIGNMENT;
+    size_t block_size = payload + sizeof(header);
+    size_t used = __atomic_fetch_add(&BOOTSTRAP_USED, block_size, __ATOMIC_RELAXED);
+    if (block_size > BOOTSTRAP_SIZE || used > BOOTSTRAP_SIZE - block_size) {
+        return NULL;
+    }
+
+    header *hdr = (header *) (BOOTSTRAP + used);
+    hdr->size = payload;
+    hdr->magic = MAGIC;
+    return (void *)(hdr + 1);
+}
+
+/**
+ * Check whether a pointer came from the bootstrap arena
+ *
+ * @param ptr The pointer
+ * @return Non-zero if the pointer is in the arena
+ */
+static int in_bootstrap(const void *ptr) {
+    return (const char *) ptr >= BOOTSTRAP && (const char *) ptr < BOOTSTRAP + BOOTSTRAP_SIZE;
+}
+
+/**
+ * Allocate a large block as a run of pages of its own
+ *
+ * Large blocks have no header; their span descriptor in the page map records the size.
+ * For alignments beyond a page, a longer run is taken and the pages on either side
+ * of the aligned block are given straight back.
+ *
+ * @param size The size of the block
+ * @param alignment The alignment of the block, a power of two of at least a page
+ * @return A pointer to the block or NULL if no run of pages was available
+ */
+static void *alloc_large(size_t size, size_t alignment) {
+    size_t npages = (size + TU_PAGE_SIZE - 1) >> TU_PAGE_SHIFT;
+    size_t extra = (alignment >> TU_PAGE_SHIFT) - 1;
+    tu_span *span = tu_span_new();
+    if (span == NULL) {
+        return NULL;
+    }
+
+    char *run = tu_pages_alloc(npages + extra);
+    if (run == NULL) {
+        tu_span_delete(span);
+        return NULL;
+    }
+
+    // Trim the run down to the aligned block
+    char *start = (char *) (((uintptr_t) run + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    size_t lead = (size_t) (start - run) >> TU_PAGE_SHIFT;
+    if (lead != 0) {
+        tu_pages_free(run, lead);
+    }
+    if (extra != lead) {
+        tu_pages_free(start + (npages << TU_PAGE_SHIFT), extra - lead);
+    }
+
+    span->start = start;
+    span->npages = npages;
+    span->size = npages << TU_PAGE_SHIFT;
+    span->kind = TU_SPAN_LARGE;
+    if (tu_pagemap_set(start, npages, span) != 0) {
+        tu_pagemap_set(start, npages, NULL);
+        tu_pages_free(start, npages);
+        tu_span_delete(span);
+        return NULL;
+    }
+    LARGE_ALLOCS++;
+    return start;
+}
+
+/**
+ * Free a large block
+ *
+ * @param span The span of the block
+ */
+static void free_large(tu_span *span) {
+    LARGE_FREES++;
+    tu_pagemap_set(span->start, span->npages, NULL);
+    tu_pages_free(span->start, span->npages);
+    tu_span_delete(span);
+}
+
+/*
+ * An allocation sampled by the heap profiler gets a run of pages of its own, with
+ * a header at the start naming it sampled and holding the size asked for, and a
+ * span pointing at the profile bucket of its stack. The page map then routes its
+ * free to free_sampled, and no other free ever has to check whether it was sampled.
+ */
+static __thread int SAMPLING __attribute__((tls_model("initial-exec"))); /**< Set while the thread takes a sample */
+
+/**
+ * Allocate a block for an allocation the heap profiler samples
+ *
+ * Called when the thread's sample countdown runs out; draws the next countdown
+ * and, if sampling is on, records the caller's stack.
+ *
+ * @param size The size asked for
+ * @return The sampled block, or NULL if the allocation is not sampled after all
+ */
+void *tu_alloc_sampled(size_t size) {
+    tu_cache *cache = &tu_thread_cache;
+    cache->sample_countdown = tu_profile_interval();
+
+    // Capturing the stack may allocate, and that allocation is not sampled
+    if (tu_profile_rate() == 0 || SAMPLING || size > SIZE_MAX - sizeof(header) - TU_PAGE_SIZE) {
+        return NULL;
+    }
+    SAMPLING = 1;
+    void *stack[TU_PROFILE_DEPTH];
+    int depth = tu_profile_backtrace(stack);
+    SAMPLING = 0;
+
+    if (tu_lock() != 0) {
+        return NULL;
+    }
+    tu_profile_bucket *bucket = tu_profile_bucket_for(stack, depth);
+    header *hdr = bucket != NULL ? alloc_large(size + sizeof(header), TU_PAGE_SIZE) : NULL;
+    if (hdr != NULL) {
+        tu_span *span = tu_pagemap_get(hdr);
+        span->kind = TU_SPAN_SAMPLED;
+        span->owner = bucket;
+        hdr->size = size;
+        hdr->magic = SAMPLED_MAGIC;
+    }
+    tu_unlock();
+
+    if (hdr == NULL) {
+        return NULL;
+    }
+    tu_profile_alloc(bucket, size);
+    return hdr + 1;
+}
 
-#include <stddef.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <string.h>
+/**
+ * Find the header of an allocated block
+ *
+ * A block moved up for alignment has a header of its own in front of it, holding
+ * the distance back to the block it was carved from; that block's header is returned.
+ *
+ * @param ptr A pointer to the block, from the heap or the bootstrap arena
+ * @param offset Set to the distance from the start of the underlying block to ptr
+ * @return The header of the underlying block
+ */
+static header *block_header(void *ptr, size_t *offset) {
+    header *hdr = (header *) ptr - 1;
+    *offset = 0;
+    if (hdr->magic == ALIGNED_MAGIC) {
+        *offset = hdr->size;
+        hdr = (header *) ((char *) ptr - hdr->size) - 1;
+    }
+    return hdr;
+}
 
+/**
+ * Free a block sampled by the heap profiler
+ *
+ * @param span The span of the block
+ * @param ptr A pointer to the block, possibly moved up for alignment
+ */
+static void free_sampled(tu_span *span, void *ptr) {
+    size_t offset;
+    header *hdr = block_header(ptr, &offset);
+    if ((char *) hdr != span->start || hdr->magic != SAMPLED_MAGIC) {
+        fail("INVALID FREE DETECTED\n");
+    }
+    tu_profile_free(span->owner, hdr->size);
+    // A block freed from inside the allocator is leaked rather than deadlocking
+    if (tu_lock() == 0) {
+        free_large(span);
+        tu_unlock();
+    }
+}
 
-#define ALIGNMENT 16 /**< The alignment of the memory blocks */
+/**
+ * Find the usable size of an allocated block
+ *
+ * @param ptr A pointer to the block
+ * @param message What to report if the pointer is not one the allocator handed out
+ * @return The number of bytes the block can hold
+ */
+static size_t usable_size(void *ptr, const char *message) {
+    size_t offset;
+    if (!in_bootstrap(ptr)) {
+        tu_span *span = tu_pagemap_get(ptr);
+        if (span == NULL) {
+            fail(message);
+        }
+        // Large blocks have no header, so the page map knows their size
+        if (span->kind == TU_SPAN_LARGE) {
+            return span->size;
+        }
+        // Sampled blocks fill their pages past the header
+        if (span->kind == TU_SPAN_SAMPLED) {
+            block_header(ptr, &offset);
+            return span->size - sizeof(header) - offset;
+        }
+    }
+    header *hdr = block_header(ptr, &offset);
+    if (hdr->magic != MAGIC) {
+        fail("MEMORY CORRUPTION DETECTED\n");
+    }
+    return hdr->size - offset;
+}
 
-static free_block *HEAD = NULL; /**< Pointer to the first element of the free list */
+/*
+ * A tu_heap is a private heap for one set of data structures, carved from runs of
+ * pages of its own so it never mixes with the global heap and can be thrown away
+ * in one go. Blocks up to HEAP_SMALL_MAX are bump allocated from chunks and, unless
+ * the heap is an arena, recycled through one free list per 16-byte size; bigger
+ * blocks get a run of pages each. Every page of a heap maps to a span that points
+ * back at the heap, so tufree and turealloc work on heap blocks too. A heap is not
+ * locked: each one is meant to be used by one thread at a time.
+ */
+struct tu_heap {
+    int flags; /**< TU_HEAP_* flags the heap was made with */
+    char *bump; /**< Next free byte of the current chunk */
+    char *bump_end; /**< End of the current chunk */
+    tu_span *chunks; /**< Chunks small blocks are carved from */
+    tu_span *blocks; /**< Runs of pages holding one big block each, doubly linked */
+    void *free_lists[HEAP_CLASSES]; /**< Freed small blocks by size, linked through their payloads */
+};
 
 /**
- * Split a free block into two blocks
+ * Get a run of pages for a heap
  *
- * @param block The block to split
- * @param size The size of the first new split block
- * @return A pointer to the first block or NULL if the block cannot be split
+ * @param heap The heap
+ * @param npages The number of pages
+ * @return The span of the run or NULL if none was available
  */
-void *split(free_block *block, int size) {
-    if((block->size < size + sizeof(free_block))) {
+static tu_span *heap_span(tu_heap *heap, size_t npages) {
+    if (tu_lock() != 0) {
         return NULL;
     }
 
-    void *split_pnt = (char *)block + size + sizeof(free_block);
-    free_block *new_block = (free_block *) split_pnt;
+    tu_span *span = tu_span_new();
+    char *start = span != NULL ? tu_pages_alloc(npages) : NULL;
+    if (start == NULL) {
+        if (span != NULL) {
+            tu_span_delete(span);
+        }
+        tu_unlock();
+        return NULL;
+    }
 
-    new_block->size = block->size - size - sizeof(free_block);
-    new_block->next = block->next;
+    span->start = start;
+    span->npages = npages;
+    span->size = npages << TU_PAGE_SHIFT;
+    span->kind = TU_SPAN_ARENA;
+    span->owner = heap;
+    if (tu_pagemap_set(start, npages, span) != 0) {
+        tu_pagemap_set(start, npages, NULL);
+        tu_pages_free(start, npages);
+        tu_span_delete(span);
+        span = NULL;
+    }
+    tu_unlock();
+    return span;
+}
 
-    block->size = size;
+/**
+ * Give a heap's run of pages back to the page allocator
+ *
+ * @param span The span of the run
+ */
+static void heap_span_free(tu_span *span) {
+    // Called from inside the allocator the pages are leaked rather than deadlocking
+    if (tu_lock() != 0) {
+        return;
+    }
+    tu_pagemap_set(span->start, span->npages, NULL);
+    tu_pages_free(span->start, span->npages);
+    tu_span_delete(span);
+    tu_unlock();
+}
 
-    return block;
+/**
+ * Create a private heap
+ *
+ * @param flags TU_HEAP_ARENA for a heap whose blocks are only given back when it is deleted
+ * @return The heap or NULL if out of memory
+ */
+tu_heap *tu_heap_new(int flags) {
+    tu_heap *heap = tucalloc(1, sizeof(tu_heap));
+    if (heap != NULL) {
+        heap->flags = flags;
+    }
+    return heap;
 }
 
 /**
- * Find the previous neighbor of a block
+ * Delete a private heap and every block still allocated from it
  *
- * @param block The block to find the previous neighbor of
- * @return A pointer to the previous neighbor or NULL if there is none
+ * @param heap The heap, or NULL
  */
-free_block *find_prev(free_block *block) {
-    free_block *curr = HEAD;
-    while(curr != NULL) {
-        char *next = (char *)curr + curr->size + sizeof(free_block);
-        if(next == (char *)block)
-            return curr;
-        curr = curr->next;
+void tu_heap_delete(tu_heap *heap) {
+    if (heap == NULL) {
+        return;
+    }
+    while (heap->chunks != NULL) {
+        tu_span *span = heap->chunks;
+        heap->chunks = span->next;
+        heap_span_free(span);
     }
-    return NULL;
+    while (heap->blocks != NULL) {
+        tu_span *span = heap->blocks;
+        heap->blocks = span->next;
+        heap_span_free(span);
+    }
+    tufree(heap);
 }
 
 /**
- * Find the next neighbor of a block
+ * Allocate from a private heap
  *
- * @param block The block to find the next neighbor of
- * @return A pointer to the next neighbor or NULL if there is none
+ * @param heap The heap
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, a power of two up to the page size; zero for the default
+ * @return A pointer to the block or NULL if the alignment is invalid or memory ran out
  */
-free_block *find_next(free_block *block) {
-    char *block_end = (char*)block + block->size + sizeof(free_block);
-    free_block *curr = HEAD;
+void *tu_heap_alloc(tu_heap *heap, size_t size, size_t alignment) {
+    if ((alignment & (alignment - 1)) != 0 || alignment > TU_PAGE_SIZE || size > SIZE_MAX - 2 * TU_PAGE_SIZE) {
+        return NULL;
+    }
+    if (alignment < ALIGNMENT) {
+        alignment = ALIGNMENT;
+    }
+    size_t payload = size ? (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1) : ALIGNMENT;
 
-    while(curr != NULL) {
-        if((char *)curr == block_end)
-            return curr;
-        curr = curr->next;
+    char *ptr;
+    if (payload <= HEAP_SMALL_MAX) {
+        // Reuse a freed block of the same size if its alignment will do
+        void **list = &heap->free_lists[(payload >> GRANULE_SHIFT) - 1];
+        if (*list != NULL && ((uintptr_t) *list & (alignment - 1)) == 0) {
+            ptr = *list;
+            *list = *(void **) ptr;
+        } else {
+            // Otherwise bump allocate, starting a new chunk when this one is used up
+            ptr = (char *) (((uintptr_t) heap->bump + sizeof(header) + alignment - 1) & ~(uintptr_t) (alignment - 1));
+            if (heap->bump == NULL || ptr + payload > heap->bump_end) {
+                tu_span *chunk = heap_span(heap, HEAP_CHUNK_PAGES);
+                if (chunk == NULL) {
+                    return NULL;
+                }
+                chunk->next = heap->chunks;
+                heap->chunks = chunk;
+                heap->bump_end = chunk->start + chunk->size;
+                ptr = (char *) (((uintptr_t) chunk->start + sizeof(header) + alignment - 1) & ~(uintptr_t) (alignment - 1));
+            }
+            heap->bump = ptr + payload;
+        }
+    } else {
+        // Big blocks get their own run, with the header just in front of the aligned payload
+        size_t npages = (alignment + payload + TU_PAGE_SIZE - 1) >> TU_PAGE_SHIFT;
+        tu_span *span = heap_span(heap, npages);
+        if (span == NULL) {
+            return NULL;
+        }
+        span->next = heap->blocks;
+        span->prev = NULL;
+        if (heap->blocks != NULL) {
+            heap->blocks->prev = span;
+        }
+        heap->blocks = span;
+        ptr = span->start + alignment;
     }
-    return NULL;
+
+    header *hdr = (header *) ptr - 1;
+    hdr->size = payload;
+    hdr->magic = MAGIC;
+    return ptr;
 }
 
 /**
- * Remove a block from the free list
+ * Free a block allocated from a private heap
  *
- * @param block The block to remove
+ * Small blocks of an arena are only given back when the arena is deleted.
+ *
+ * @param heap The heap the block came from
+ * @param ptr Pointer to the block, or NULL
  */
-void remove_free_block(free_block *block) {
-    free_block *curr = HEAD;
-    if(curr == block) {
-        HEAD = block->next;
+void tu_heap_free(tu_heap *heap, void *ptr) {
+    if (ptr == NULL) {
         return;
     }
-    while(curr != NULL) {
-        if(curr->next == block) {
-            curr->next = block->next;
-            return;
+
+    header *hdr = (header *) ptr - 1;
+    if (hdr->magic != MAGIC) {
+        fail("MEMORY CORRUPTION DETECTED\n");
+    }
+    hdr->magic = 0;
+
+    if (hdr->size > HEAP_SMALL_MAX) {
+        tu_span *span = tu_pagemap_get(ptr);
+        if (span->prev != NULL) {
+            span->prev->next = span->next;
+        } else {
+            heap->blocks = span->next;
         }
-        curr = curr->next;
+        if (span->next != NULL) {
+            span->next->prev = span->prev;
+        }
+        heap_span_free(span);
+    } else if (!(heap->flags & TU_HEAP_ARENA)) {
+        void **list = &heap->free_lists[(hdr->size >> GRANULE_SHIFT) - 1];
+        *(void **) ptr = *list;
+        *list = ptr;
     }
 }
 
 /**
- * Coalesce neighboring free blocks
+ * Check whether an address is in memory the allocator manages
+ *
+ * The answer comes from the page map alone, so any address can be asked about,
+ * including interior pointers and pointers from other allocators.
+ *
+ * @param ptr The address
+ * @return Non-zero if the address is in the heap or in a large block
+ */
+int tumalloc_owns(const void *ptr) {
+    tu_span *span = tu_pagemap_get(ptr);
+    if (span == NULL) {
+        return in_bootstrap(ptr);
+    }
+    if (span->kind == TU_SPAN_LARGE) {
+        return (const char *) ptr < span->start + span->size;
+    }
+    return 1;
+}
+
+/**
+ * Allocate a block with the allocator lock held
  *
- * @param block The block to coalesce
- * @return A pointer to the first block of the coalesced blocks
+ * @param size The amount of memory to allocate, small enough not to overflow
+ * @return A pointer to the requested block of memory
  */
-void *coalesce(free_block *block) {
-    if (block == NULL) {
+static void *heap_alloc(size_t size) {
+
+    // Round the payload up so the next block stays aligned; zero still gets a usable block
+    size_t payload = size ? (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1) : ALIGNMENT;
+    size_t block_size = payload + sizeof(header);
+
+    // The free index counts sizes in 32-bit granules, so no block may be bigger than that
+    if ((block_size >> GRANULE_SHIFT) > MAX_GRANULES) {
         return NULL;
     }
 
-    free_block *prev = find_prev(block);
-    free_block *next = find_next(block);
+    // Large requests get a run of pages of their own, so freeing them hands the pages straight back
+    header *hdr = NULL;
+    if (block_size >= LARGE_THRESHOLD) {
+        void *large = alloc_large(payload, TU_PAGE_SIZE);
+        if (large != NULL) {
+            return large;
+        }
+        // Without a page region the heap still serves it
+    }
 
-    // Coalesce with previous block if it is contiguous.
-    if (prev != NULL) {
-        char *end_of_prev = (char *)prev + prev->size + sizeof(free_block);
-        if (end_of_prev == (char *)block) {
-            prev->size += block->size + sizeof(free_block);
+    // Small requests are carved straight off the last remainder when it has room
+    int small = block_size <= LAST_REMAINDER_MAX;
+    if (small) {
+        hdr = (header *) take_last_remainder(block_size);
+    }
 
-            // Ensure prev->next is updated to skip over 'block', only if 'block' is directly next to 'prev'.
-            if (prev->next == block) {
-                prev->next = block->next;
+    // Otherwise look for a free block to allocate from, and failing that split the top chunk
+    if (hdr == NULL) {
+        size_t slot = find_fit(block_size);
+        if (slot != NO_BLOCK) {
+            // Start pulling in the header line while the index is updated
+            __builtin_prefetch(from_ref(FREE_STARTS[slot]), 1, 3);
+            if (small)
+                hdr = (header *) split_last_remainder(slot, block_size);
+            else
+                hdr = (header *) split(slot, block_size);
+        } else if (!small && (hdr = (header *) take_last_remainder(block_size)) != NULL) {
+            // The last remainder can also be bigger than anything left in the index
+        } else {
+            hdr = (header *) take_top(block_size);
+            // This will be taken if there was an issue with sbrk or do_alloc
+            if (hdr == NULL) {
+                return NULL;
             }
-            block = prev; // Update block to point to the new coalesced block.
         }
     }
 
-    // Coalesce with next block if it is contiguous.
-    if (next != NULL) {
-        char *end_of_block = (char *)block + block->size + sizeof(free_block);
-        if (end_of_block == (char *)next) {
-            block->size += next->size + sizeof(free_block);
+#ifdef TU_PREFETCH_NEXT
+    // Both first fit and the last remainder hand the next request of this size the bytes right after this block
+    __builtin_prefetch((char *) hdr + block_size, 1, 3);
+#endif
+
+    // Create header & add information
+    hdr->size = payload;
+    hdr->magic = MAGIC;
+    // Return the pointer to the memory after the header
+    return (void *)(hdr + 1);
+}
+
+/*
+ * Small blocks are recycled through a cache per thread, so most allocations and
+ * frees of small sizes take no lock. The cache holds ordinary heap blocks of the
+ * class sizes: a miss takes a batch of them from the heap under the lock, in
+ * address order, and a free that finds its list full goes straight to the heap.
+ * When a thread exits, its cache is emptied back into the heap.
+ */
+__thread tu_cache tu_thread_cache __attribute__((tls_model("initial-exec")));
+
+static pthread_once_t CACHE_KEY_ONCE = PTHREAD_ONCE_INIT; /**< Guards creation of CACHE_KEY */
+static pthread_key_t CACHE_KEY; /**< Key whose destructor empties a thread's cache when it exits */
+static tu_cache *CACHES = NULL; /**< Caches of the live threads, for tumalloc_stats */
+static uint64_t RETIRED_ALLOCS[TU_NUM_CLASSES + 1]; /**< Allocations counted by the caches of exited threads */
+static uint64_t RETIRED_FREES[TU_NUM_CLASSES + 1]; /**< Frees counted by the caches of exited threads */
+static uint64_t RETIRED_REQUESTED[TU_NUM_CLASSES + 1]; /**< Bytes requested, counted by the caches of exited threads */
+
+/**
+ * Empty a thread's cache back into the heap as the thread exits
+ *
+ * @param arg The thread's cache
+ */
+static void cache_exit(void *arg) {
+    tu_cache *cache = arg;
+
+    // Frees made after this point, by other destructors, go straight to the heap
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        cache->limits[cls] = 0;
+    }
+    cache->state = 2;
+    if (tu_lock() != 0) {
+        return;
+    }
+
+    // Keep the thread's counts once its cache is gone
+    if (cache->prev != NULL) {
+        cache->prev->next = cache->next;
+    } else if (CACHES == cache) {
+        CACHES = cache->next;
+    }
+    if (cache->next != NULL) {
+        cache->next->prev = cache->prev;
+    }
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        RETIRED_ALLOCS[cls] += cache->allocs[cls];
+        RETIRED_FREES[cls] += cache->frees[cls];
+        RETIRED_REQUESTED[cls] += cache->requested[cls];
+    }
 
-            // Ensure block->next is updated to skip over 'next'.
-            block->next = next->next;
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        while (cache->heads[cls] != NULL) {
+            char *ptr = cache->heads[cls];
+            cache->heads[cls] = *(void **) ptr;
+            coalesce(ptr - sizeof(header), ((header *) ptr - 1)->size + sizeof(header));
         }
+        __atomic_store_n(&cache->counts[cls], 0, __ATOMIC_RELAXED);
     }
+    tu_unlock();
+}
 
-    return block;
+/**
+ * Create the key that empties caches of exiting threads
+ */
+static void cache_key_create(void) {
+    pthread_key_create(&CACHE_KEY, cache_exit);
 }
 
 /**
- * Call sbrk to get memory from the OS
+ * Set up the calling thread's cache
  *
- * @param size The amount of memory to allocate
- * @return A pointer to the allocated memory
+ * @param cache The thread's cache
  */
-void *do_alloc(size_t size) {
+static void cache_init(tu_cache *cache) {
+    // Set up before registering, since registering may allocate
+    cache->state = 1;
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        // Bigger classes cache fewer blocks, but always at least one
+        size_t limit = CACHE_CLASS_BYTES / (tu_class_size[cls] + sizeof(header));
+        cache->limits[cls] = limit > CACHE_LIMIT ? CACHE_LIMIT : (limit ? (uint32_t) limit : 1);
+    }
 
-    // Ensure that the input size is greater than zero
-    if (size <= 0) return NULL;
+    // A cache first used from inside the allocator goes unregistered, and its counts uncounted
+    if (tu_lock() == 0) {
+        cache->next = CACHES;
+        if (CACHES != NULL) {
+            CACHES->prev = cache;
+        }
+        CACHES = cache;
+        tu_unlock();
+    }
+    pthread_once(&CACHE_KEY_ONCE, cache_key_create);
+    pthread_setspecific(CACHE_KEY, cache);
+}
 
-    // Ensure the size is a multiple of 16, which is the alignment value.
-    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+/**
+ * Allocate a block of a size class when the thread cache has none
+ *
+ * @param cls The size class
+ * @return A pointer to the block or NULL if out of memory
+ */
+void *tu_alloc_class_slow(unsigned cls) {
+    tu_cache *cache = &tu_thread_cache;
+    if (cache->state == 0) {
+        cache_init(cache);
+    }
 
-    // Use sbrk to allocate more memory according to the size input in the function. sbrk returns the new break address (pointer), which means the address the heap ends at at the bottom and breaks up the end of the heap and start of unallocated memory
-    void *ptr = sbrk(size);
+    size_t payload = tu_class_size[cls];
+    if (tu_lock() != 0) {
+        return bootstrap_alloc(payload);
+    }
 
-    // Check to see if the allocation suceeded; if not, return null. This call could fail for reasons including that the requested memory exceeds the process's limits, or if there's insufficient memory available on the system.
-    if (ptr == (void *)-1) {
-        return NULL;
+    // Take one block for the caller and, unless caching is off, a batch more for the cache
+    size_t batch = CACHE_BATCH_BYTES / (payload + sizeof(header));
+    if (batch > cache->limits[cls]) {
+        batch = cache->limits[cls];
     }
-    // If the allocation did succeed, the code will reach this point and will return the correct pointer
+    void *ptr = heap_alloc(payload);
+    void *list = NULL;
+    void **tail = &list;
+    for (size_t i = 1; ptr != NULL && i < batch; i++) {
+        void *extra = heap_alloc(payload);
+        if (extra == NULL) {
+            break;
+        }
+        ((header *) extra - 1)->magic = 0;
+        *tail = extra;
+        tail = (void **) extra;
+        TU_CACHE_ADD(cache->counts[cls], 1);
+    }
+    tu_unlock();
+
+    // Pops then run in address order
+    *tail = cache->heads[cls];
+    cache->heads[cls] = list;
     return ptr;
 }
 
+/**
+ * Free a block of a size class when the thread cache has no room for it
+ *
+ * @param ptr Pointer to the block, with the magic number already cleared
+ * @param cls The size class
+ */
+void tu_free_class_slow(void *ptr, unsigned cls) {
+    tu_cache *cache = &tu_thread_cache;
+    if (cache->state == 0) {
+        cache_init(cache);
+        tu_free_class(ptr, cls);
+        return;
+    }
+
+    // The cache is full or switched off, so the block goes back to the heap
+    if (tu_lock() == 0) {
+        coalesce((char *) ptr - sizeof(header), ((header *) ptr - 1)->size + sizeof(header));
+        tu_unlock();
+    }
+}
+
+/**
+ * Find the size class a heap block can be cached under
+ *
+ * @param hdr The block's header
+ * @return The size class, or 0 if the block is not the size of one
+ */
+static unsigned block_class(const header *hdr) {
+    if (hdr->size > TU_SMALL_MAX) {
+        return 0;
+    }
+    unsigned cls = tu_size_class(hdr->size);
+    return tu_class_size[cls] == hdr->size ? cls : 0;
+}
+
 /**
  * Allocates memory for the end user
  *
  * @param size The amount of memory to allocate
  * @return A pointer to the requested block of memory
  */
-void *tumalloc(size_t size) {
-    
-    // If the free list is empty call do_alloc to allocate new memory
-    if (HEAD == NULL) {
-        void *raw = do_alloc(size + sizeof(header));
-        // This will be taken if there was an issue with sbrk or do_alloc
-        if (raw == NULL) {
-            return NULL;
-        }
+void *(tumalloc)(size_t size) {
 
-        // Create header & add information
-        header *hdr = (header *)raw;
-        hdr->size = size;
-        hdr->magic = 0x01234567;
-        return (void *)(hdr + 1);
-    }
-
-    // Free list is not empty, so look for a block to allocate from
-    else {
-        free_block *block = HEAD;
-        // Loop through the list of free blocks
-        while (block != NULL) {
-            // If the block is big enough, split it and return the pointer
-            if (size + sizeof(header) <= block->size) {
-                header *hdr = (header *) split(block, size + sizeof(header));
-                // If the block was split, remove it from the free list
-                if (hdr == NULL) {
-                    remove_free_block(block);
-                    hdr = (header *) block;
-                } else {
-                    remove_free_block((free_block *) hdr);
-                }
-                // Create header & add information
-                hdr->size = size;
-                hdr->magic = 0x01234567;
-                // Return the pointer to the memory after the header
-                return (void *)(hdr + 1);
-            }
-            block = block->next;
+    // Small requests come from the thread cache
+    if (size <= TU_SMALL_MAX) {
+        return tu_alloc_class(tu_size_class(size), size);
+    }
+
+    // Refuse sizes that would overflow once the header and padding are added
+    if (size > SIZE_MAX - sizeof(header) - ALIGNMENT) {
+        return NULL;
+    }
+
+    // Bigger requests count towards the next heap profile sample too
+    tu_cache *cache = &tu_thread_cache;
+    if (__builtin_expect((cache->sample_countdown -= (int64_t) size) < 0, 0)) {
+        void *sampled = tu_alloc_sampled(size);
+        if (sampled != NULL) {
+            return sampled;
         }
-        // If no block was found, allocate a new one
-        void *raw = do_alloc(size + sizeof(header));
-        header *hdr = (header *)raw;
-        hdr->size = size;
-        hdr->magic = 0x01234567;
-        return (void *)(hdr + 1);
     }
+
+    // An allocation from inside the allocator cannot wait for the lock it already holds
+    if (tu_lock() != 0) {
+        return bootstrap_alloc(size);
+    }
+    void *ptr = heap_alloc(size);
+    tu_unlock();
+    return ptr;
 }
 
+/**
+ * Allocates memory with a given alignment
+ *
+ * Alignments up to a page are met by over-allocating from the heap and moving the
+ * block up; the moved block gets a header of its own pointing back at the real one.
+ * Bigger alignments get a run of pages of their own.
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the aligned block or NULL if the alignment is invalid or memory ran out
+ */
+void *tumemalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    // Every block is aligned this much anyway
+    if (alignment <= ALIGNMENT) {
+        return tumalloc(size);
+    }
+
+    if (alignment > TU_PAGE_SIZE) {
+        if (size > SIZE_MAX - alignment || tu_lock() != 0) {
+            return NULL;
+        }
+        void *large = alloc_large(size ? size : ALIGNMENT, alignment);
+        tu_unlock();
+        return large;
+    }
+
+    // Large blocks are page aligned, so only heap blocks ever need moving
+    if (size > SIZE_MAX - alignment) {
+        return NULL;
+    }
+    char *base = tumalloc(size + alignment);
+    if (base == NULL) {
+        return NULL;
+    }
+    char *ptr = (char *) (((uintptr_t) base + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    if (ptr != base) {
+        // Blocks are 16-byte aligned, so there is always room for the header in between
+        header *hdr = (header *) ptr - 1;
+        hdr->size = ptr - base;
+        hdr->magic = ALIGNED_MAGIC;
+    }
+    return ptr;
+}
 
+/**
+ * Find how many bytes an allocated block can hold
+ *
+ * @param ptr A pointer to an allocated block, or NULL
+ * @return The usable size of the block, which is at least what was asked for
+ */
+size_t tumalloc_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return usable_size(ptr, "INVALID POINTER PASSED TO USABLE SIZE\n");
+}
 
 /**
  * Allocates and initializes a list of elements for the end user
@@ -221,8 +1863,11 @@ void *tumalloc(size_t size) {
  * @return A pointer to the requested block of initialized memory
  */
 void *tucalloc(size_t num, size_t size) {
-    // Calculate the total needed size
-    size_t total_size = num * size;
+    // Calculate the total needed size, refusing counts that overflow
+    size_t total_size;
+    if (__builtin_mul_overflow(num, size, &total_size)) {
+        return NULL;
+    }
 
     // If input is 0, return NULL
     if (total_size == 0) {
@@ -237,14 +1882,16 @@ void *tucalloc(size_t num, size_t size) {
         return NULL;
     }
 
-    // Initialize the allocated memory to 0
-    memset(ptr, 0, total_size);
+    // Initialize the allocated memory to 0, without flooding the cache for big blocks
+    tu_zero(ptr, total_size);
     return ptr;
 }
 
 /**
  * Reallocates a chunk of memory with a bigger size
  *
+ * When a new block is needed, the contents are copied over and the old block is freed.
+ *
  * @param ptr A pointer to an already allocated piece of memory
  * @param new_size The new requested size to allocate
  * @return A new pointer containing the contents of ptr, but with the new_size
@@ -259,25 +1906,25 @@ void *turealloc(void *ptr, size_t new_size) {
         return NULL;
     }
 
-    // Get the header of the block
-    header *old_header = (header *)ptr - 1;
+    // Find out how much the block can hold; large blocks have no header, so ask the page map
+    size_t old_size = usable_size(ptr, "INVALID POINTER PASSED TO REALLOC\n");
 
     // If the old block is big enough already, no need to allocate new block; return old pointer
-    if (old_header->size >= new_size) {
+    if (old_size >= new_size) {
         return ptr;
     }
 
     // Otherwise, allocate a new block
     void *new_ptr = tumalloc(new_size);
     
-    // If the allocation failed
+    // If the allocation failed, the old block is left alone
     if (!new_ptr) {
         return NULL;
     }
 
-    // Copy the old data to the new block
-    size_t copy_size = old_header->size < new_size ? old_header->size : new_size;
-    memcpy(new_ptr, ptr, copy_size);
+    // Copy the old data to the new block and let the old one go
+    tu_copy(new_ptr, ptr, old_size);
+    tufree(ptr);
 
     // Return the new pointer
     return new_ptr;
@@ -288,25 +1935,209 @@ void *turealloc(void *ptr, size_t new_size) {
  *
  * @param ptr Pointer to the allocated piece of memory
  */
-void tufree(void *ptr) {
+void (tufree)(void *ptr) {
+
+    // Freeing NULL does nothing, and bootstrap blocks are never reused
+    if (ptr == NULL || in_bootstrap(ptr)) {
+        return;
+    }
 
-    // Convert the user pointer to the header pointer
-    header *hdr = (header *)((char *)ptr - sizeof(header));
+    // Foreign pointers are caught through the page map before anything is read through them
+    tu_span *span = tu_pagemap_get(ptr);
+    if (span == NULL) {
+        fail("INVALID FREE DETECTED\n");
+    }
+
+    // Blocks of a private heap go back to that heap
+    if (span->kind == TU_SPAN_ARENA) {
+        tu_heap_free(span->owner, ptr);
+        return;
+    }
+
+    // Large blocks give their run of pages back to the page allocator
+    if (span->kind == TU_SPAN_LARGE) {
+        if (ptr != span->start) {
+            fail("INVALID FREE DETECTED\n");
+        }
+        // A block freed from inside the allocator is leaked rather than deadlocking
+        if (tu_lock() == 0) {
+            free_large(span);
+            tu_unlock();
+        }
+        return;
+    }
+
+    // So do blocks the heap profiler sampled, once the profile has counted the free
+    if (span->kind == TU_SPAN_SAMPLED) {
+        free_sampled(span, ptr);
+        return;
+    }
+
+    // Convert the user pointer to the header pointer, stepping back over any alignment
+    size_t offset;
+    header *hdr = block_header(ptr, &offset);
 
     // Check the magic number; take top path if it's correct
-    if (hdr->magic == 0x01234567) {
-        // Convert the user pointer to the header pointer
-        free_block *block = (free_block *)hdr;
-        // Set the size of the block to the size of the header
-        block->size = hdr->size;
-        // Insert the block at the beginning of the free list
-        block->next = HEAD;
-        HEAD = block;
-        // Coalesce the block with any surrounding free blocks
-        coalesce(block);
+    if (hdr->magic == MAGIC) {
+        // Clear the magic numbers so a second free of the same block is caught
+        if (offset != 0) {
+            ((header *) ptr - 1)->magic = 0;
+        }
+        hdr->magic = 0;
+        // Blocks of a size class go to the thread cache
+        unsigned cls = block_class(hdr);
+        if (cls != 0) {
+            tu_free_class(hdr + 1, cls);
+            return;
+        }
+        // Hand the whole block, header included, back to the free index
+        if (tu_lock() == 0) {
+            coalesce((char *)hdr, hdr->size + sizeof(header));
+            tu_unlock();
+        }
     // If the magic number is not correct, print that there's memory corruption
     } else {
-        printf("MEMORY CORRUPTION DETECTED\n");
-        abort();
+        fail("MEMORY CORRUPTION DETECTED\n");
+    }
+}
+
+/**
+ * Removes a chunk of memory whose requested size is known
+ *
+ * The size only picks the size class; the block goes back to the thread cache
+ * when the header's size matches that class. Everything else, including a block
+ * realloc shrank in place, a block of a private heap or one sampled by the
+ * profiler, goes through tufree, which frees it by its header.
+ *
+ * @param ptr Pointer to the allocated piece of memory, from tumalloc
+ * @param size The size that was asked for when it was allocated
+ */
+void (tufree_sized)(void *ptr, size_t size) {
+    if (ptr == NULL || in_bootstrap(ptr)) {
+        return;
+    }
+
+    // Private heaps and sampled blocks share the header layout, so the page map must place the block in the heap
+    tu_span *span = tu_pagemap_get(ptr);
+    header *hdr = (header *)ptr - 1;
+    if (span != NULL && span->kind == TU_SPAN_HEAP && size <= TU_SMALL_MAX && hdr->magic == MAGIC) {
+        unsigned cls = tu_size_class(size);
+        if (tu_class_size[cls] == hdr->size) {
+            hdr->magic = 0;
+            tu_free_class(ptr, cls);
+            return;
+        }
+    }
+    (tufree)(ptr);
+}
+
+/**
+ * Take a snapshot of the allocator's statistics
+ *
+ * Per-class counts are kept by each thread's cache without any locking, stored and
+ * loaded here with relaxed atomics, and added up together with those of threads
+ * that have exited. A snapshot taken while other threads run may therefore be off
+ * by the operations they are in the middle of, but never reads a torn count.
+ *
+ * @param stats Where to store the statistics
+ */
+void tumalloc_stats(tu_stats *stats) {
+    *stats = (tu_stats) {0};
+    if (tu_lock() != 0) {
+        return;
+    }
+
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        tu_class_stats *class_stats = &stats->classes[cls];
+        uint64_t requested = RETIRED_REQUESTED[cls];
+        class_stats->size = tu_class_size[cls];
+        class_stats->allocs = RETIRED_ALLOCS[cls];
+        class_stats->frees = RETIRED_FREES[cls];
+        for (tu_cache *cache = CACHES; cache != NULL; cache = cache->next) {
+            class_stats->allocs += __atomic_load_n(&cache->allocs[cls], __ATOMIC_RELAXED);
+            class_stats->frees += __atomic_load_n(&cache->frees[cls], __ATOMIC_RELAXED);
+            class_stats->cached += __atomic_load_n(&cache->counts[cls], __ATOMIC_RELAXED);
+            requested += __atomic_load_n(&cache->requested[cls], __ATOMIC_RELAXED);
+        }
+        if (class_stats->allocs != 0) {
+            class_stats->fragmentation = 1.0 - (double) requested / ((double) class_stats->allocs * class_stats->size);
+        }
+        stats->cached += class_stats->cached * (class_stats->size + sizeof(header));
+    }
+
+    // Everything the heap holds is in the free index, the last remainder, the top chunk, a cache or live
+    for (size_t slot = 0; slot < FREE_COUNT; slot++) {
+        stats->free += (size_t) FREE_SIZES[slot] << GRANULE_SHIFT;
+    }
+    stats->free += LAST_REMAINDER_SIZE + TOP_SIZE;
+    stats->mapped = HEAP_BYTES + (tu_pages_used() << TU_PAGE_SHIFT);
+    stats->live = stats->mapped > stats->free + stats->cached ? stats->mapped - stats->free - stats->cached : 0;
+    stats->metadata = FREE_CAPACITY * INDEX_SLOT_BYTES + tu_pagemap_metadata();
+    stats->large_allocs = LARGE_ALLOCS;
+    stats->large_frees = LARGE_FREES;
+    tu_unlock();
+
+    if (stats->mapped != 0) {
+        stats->fragmentation = (double) (stats->free + stats->cached) / (double) stats->mapped;
+    }
+}
+
+#ifdef TU_HISTOGRAM
+/*
+ * With TU_HISTOGRAM the fast paths count every request by size, for
+ * tools/tune_size_classes to fit size classes to. The histogram can be dumped
+ * with tumalloc_dump_histogram, and is dumped at exit to the file named by the
+ * TUMALLOC_HISTOGRAM_FILE environment variable if it is set.
+ */
+uint64_t tu_size_histogram[TU_HISTOGRAM_BUCKETS];
+
+/**
+ * Write the size histogram as text
+ *
+ * Each line holds the biggest size a bucket counts and how many requests fell in
+ * it; empty buckets are left out.
+ *
+ * @param fd The file descriptor to write to
+ * @return 0 on success, -1 on a write error
+ */
+int tumalloc_dump_histogram(int fd) {
+    tu_out out;
+    tu_out_init(&out, fd, 0);
+    tu_out_printf(&out, "# tumalloc size histogram v1\n# size count\n");
+    for (size_t bucket = 0; bucket < TU_HISTOGRAM_BUCKETS; bucket++) {
+        uint64_t count = __atomic_load_n(&tu_size_histogram[bucket], __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+        // Exact buckets end at a multiple of 16, the rest at a power of two
+        unsigned long long size = bucket <= TU_HISTOGRAM_EXACT_MAX / 16
+            ? (unsigned long long) bucket * 16
+            : 1ULL << (bucket - TU_HISTOGRAM_EXACT_MAX / 16 - 1 + 17);
+        if (bucket == TU_HISTOGRAM_BUCKETS - 1) {
+            size = ~0ULL;
+        }
+        tu_out_printf(&out, "%llu %llu\n", size, (unsigned long long) count);
     }
+    return tu_out_flush(&out);
+}
+
+/**
+ * Dump the size histogram at exit, if TUMALLOC_HISTOGRAM_FILE names a file for it
+ *
+ * A %p in the name is replaced by the process ID, so that every process of a
+ * preloaded pipeline keeps its own histogram.
+ */
+__attribute__((destructor)) static void dump_histogram_at_exit(void) {
+    const char *name = getenv("TUMALLOC_HISTOGRAM_FILE");
+    if (name == NULL || *name == '\0') {
+        return;
     }
+    char path[4096];
+    tu_expand_path(path, sizeof(path), name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        tumalloc_dump_histogram(fd);
+        close(fd);
+    }
+}
+#endif
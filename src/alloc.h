@@ -2,6 +2,16 @@
 #define CYB3053_PROJECT2_ALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include "pagemap.h"
+#include "size_classes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TU_MAGIC 0x01234567 /**< Magic number stored in the header of every allocated block */
 
 /**
  * Header for allocated blocks
@@ -11,17 +21,298 @@ typedef struct header {
     int magic; /**< Magic number for error checking */
 } header;
 
+#define TU_HEAP_ARENA 1 /**< tu_heap_new flag: blocks are only given back when the heap is deleted */
+
+typedef struct tu_heap tu_heap; /**< A private heap, see tu_heap_new */
+
 /**
- * Free block structure
+ * Per-thread cache of free small blocks, one list per size class
+ *
+ * Cached blocks keep their header, with the magic number cleared, and are linked
+ * through the first word of their payload. The cache also counts the thread's
+ * allocations and frees of each class; tumalloc_stats adds them up across threads.
  */
-typedef struct free_block {
-    size_t size; /**< Size of the block */
-    struct free_block *next; /**< Pointer to the next free block */
-} free_block;
+typedef struct tu_cache {
+    void *heads[TU_NUM_CLASSES + 1]; /**< First cached block of each class */
+    uint32_t counts[TU_NUM_CLASSES + 1]; /**< Number of cached blocks of each class */
+    uint32_t limits[TU_NUM_CLASSES + 1]; /**< Most blocks cached per class; zero sends every free to the heap */
+    int64_t sample_countdown; /**< Bytes the thread allocates before its next heap profile sample */
+    uint64_t allocs[TU_NUM_CLASSES + 1]; /**< Blocks of each class allocated by the thread */
+    uint64_t frees[TU_NUM_CLASSES + 1]; /**< Blocks of each class freed by the thread */
+    uint64_t requested[TU_NUM_CLASSES + 1]; /**< Bytes asked for in the thread's allocations of each class */
+    struct tu_cache *next; /**< Next cache of a live thread */
+    struct tu_cache *prev; /**< Previous cache of a live thread */
+    int state; /**< 0 before the thread's first slow path, 1 while it runs, 2 once it has exited */
+} tu_cache;
+
+#define TU_STATS_PROMETHEUS 0 /**< tumalloc_dump_stats format: Prometheus text exposition */
+#define TU_STATS_JSON 1 /**< tumalloc_dump_stats format: one JSON object */
+
+/**
+ * Statistics of one size class, see tumalloc_stats
+ */
+typedef struct tu_class_stats {
+    size_t size; /**< Payload size of the class */
+    uint64_t allocs; /**< Blocks of the class allocated so far */
+    uint64_t frees; /**< Blocks of the class freed so far */
+    uint64_t cached; /**< Blocks of the class sitting in thread caches */
+    double fragmentation; /**< Share of the bytes allocated in the class lost to rounding up to its size */
+} tu_class_stats;
+
+/**
+ * Statistics of the whole allocator, see tumalloc_stats
+ */
+typedef struct tu_stats {
+    size_t mapped; /**< Bytes of memory taken from the system for blocks: the sbrk heap and runs of pages */
+    size_t live; /**< Bytes in blocks handed out and not yet freed, headers included */
+    size_t free; /**< Bytes of heap free for reuse: the free index, the last remainder and the top chunk */
+    size_t cached; /**< Bytes of blocks sitting in thread caches, headers included */
+    size_t metadata; /**< Bytes mapped for the free index, the page map and span descriptors */
+    uint64_t large_allocs; /**< Blocks given a run of pages of their own, large or sampled, allocated so far */
+    uint64_t large_frees; /**< Blocks given a run of pages of their own, large or sampled, freed so far */
+    double fragmentation; /**< Share of the mapped memory that is free or cached rather than live */
+    tu_class_stats classes[TU_NUM_CLASSES + 1]; /**< Statistics of each size class; entry 0 is unused */
+} tu_stats;
+
+extern __thread tu_cache tu_thread_cache __attribute__((tls_model("initial-exec")));
 
 void *tumalloc(size_t size);
 void *tucalloc(size_t num, size_t size);
 void *turealloc(void *ptr, size_t new_size);
 void tufree(void *ptr);
+void tufree_sized(void *ptr, size_t size);
+void *tumemalign(size_t alignment, size_t size);
+size_t tumalloc_usable_size(void *ptr);
+int tumalloc_owns(const void *ptr);
+tu_heap *tu_heap_new(int flags);
+void tu_heap_delete(tu_heap *heap);
+void *tu_heap_alloc(tu_heap *heap, size_t size, size_t alignment);
+void tu_heap_free(tu_heap *heap, void *ptr);
+void tumalloc_stats(tu_stats *stats);
+int tumalloc_dump_stats(int fd, int format);
+int tumalloc_serve_stats(const char *path, int format);
+void tumalloc_set_profile_rate(size_t rate);
+int tumalloc_dump_profile(int fd);
+void *tu_alloc_sampled(size_t size);
+void *tu_alloc_class_slow(unsigned cls);
+void tu_free_class_slow(void *ptr, unsigned cls);
+
+#ifdef __cplusplus
+#define TU_CONST_TABLE static constexpr /**< Lets C++ look classes up in constant expressions */
+#else
+#define TU_CONST_TABLE static const /**< Constant indexes into these still fold in C */
+#endif
+
+TU_CONST_TABLE uint8_t tu_class_lookup[] = { TU_CLASS_LOOKUP }; /**< Class of each request size, in 16-byte steps */
+TU_CONST_TABLE uint32_t tu_class_size[] = { 0, TU_CLASS_SIZES }; /**< Payload size of each class */
+
+/**
+ * Find the size class of a small request
+ *
+ * Sizes up to TU_LOOKUP_MAX are one table load. Above that, each power of two
+ * holds 2^TU_CLASS_STEP_BITS classes, so the class comes from the highest set
+ * bit of the size and the bits just below it.
+ *
+ * @param size The size, at most TU_SMALL_MAX
+ * @return The size class
+ */
+static inline unsigned tu_size_class(size_t size) {
+    if (size <= TU_LOOKUP_MAX) {
+        return tu_class_lookup[(size + 15) >> 4];
+    }
+    unsigned top = 63 - (unsigned) __builtin_clzll((unsigned long long) (size - 1));
+    unsigned step = (unsigned) ((size - 1) >> (top - TU_CLASS_STEP_BITS)) & ((1u << TU_CLASS_STEP_BITS) - 1);
+    return TU_FIRST_STEP_CLASS + ((top - TU_LOOKUP_SHIFT) << TU_CLASS_STEP_BITS) + step;
+}
+
+#ifdef TU_HISTOGRAM
+#define TU_HISTOGRAM_EXACT_MAX (64 * 1024) /**< Requests up to this size are counted in 16-byte steps */
+#define TU_HISTOGRAM_BUCKETS (TU_HISTOGRAM_EXACT_MAX / 16 + 1 + 48) /**< 16-byte steps, then one bucket per power of two */
+
+extern uint64_t tu_size_histogram[TU_HISTOGRAM_BUCKETS];
+
+int tumalloc_dump_histogram(int fd);
+
+/**
+ * Count a request in the size histogram
+ *
+ * Built with TU_HISTOGRAM only. Requests up to TU_HISTOGRAM_EXACT_MAX are counted
+ * in 16-byte steps and bigger ones by power of two, with one relaxed atomic add.
+ *
+ * @param size The size asked for
+ */
+static inline void tu_histogram_record(size_t size) {
+    size_t bucket;
+    if (size <= TU_HISTOGRAM_EXACT_MAX) {
+        bucket = (size + 15) >> 4;
+    } else {
+        bucket = TU_HISTOGRAM_EXACT_MAX / 16 + 1 + (47 - (size_t) __builtin_clzll((unsigned long long) (size - 1)));
+    }
+    __atomic_fetch_add(&tu_size_histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+#else
+/**
+ * Count a request in the size histogram; does nothing unless built with TU_HISTOGRAM
+ *
+ * @param size The size asked for
+ */
+static inline void tu_histogram_record(size_t size) {
+    (void) size;
+}
+#endif
+
+/*
+ * Only the owning thread writes its cache's counters, but tumalloc_stats reads
+ * them from other threads, so they are stored with relaxed atomics. On x86-64
+ * these are the same plain moves as before.
+ */
+#define TU_CACHE_ADD(counter, amount) __atomic_store_n(&(counter), (counter) + (amount), __ATOMIC_RELAXED)
+
+/**
+ * Allocate a block of a size class from the thread cache
+ *
+ * @param cls The size class
+ * @param size The size asked for, counted towards the class's fragmentation
+ * @return A pointer to the block or NULL if out of memory
+ */
+static inline void *tu_alloc_class(unsigned cls, size_t size) {
+    tu_cache *cache = &tu_thread_cache;
+    if (__builtin_expect((cache->sample_countdown -= (int64_t) size) < 0, 0)) {
+        void *sampled = tu_alloc_sampled(size);
+        if (sampled != NULL) {
+            return sampled;
+        }
+    }
+    TU_CACHE_ADD(cache->allocs[cls], 1);
+    TU_CACHE_ADD(cache->requested[cls], size);
+    void *ptr = cache->heads[cls];
+    if (__builtin_expect(ptr != NULL, 1)) {
+        cache->heads[cls] = *(void **) ptr;
+        TU_CACHE_ADD(cache->counts[cls], -1);
+        ((header *) ptr - 1)->magic = TU_MAGIC;
+        return ptr;
+    }
+    return tu_alloc_class_slow(cls);
+}
+
+/**
+ * Give a block of a size class back to the thread cache
+ *
+ * @param ptr Pointer to the block, with the magic number already cleared
+ * @param cls The size class
+ */
+static inline void tu_free_class(void *ptr, unsigned cls) {
+    tu_cache *cache = &tu_thread_cache;
+    TU_CACHE_ADD(cache->frees[cls], 1);
+    if (__builtin_expect(cache->counts[cls] < cache->limits[cls], 1)) {
+        *(void **) ptr = cache->heads[cls];
+        cache->heads[cls] = ptr;
+        TU_CACHE_ADD(cache->counts[cls], 1);
+        return;
+    }
+    tu_free_class_slow(ptr, cls);
+}
+
+/**
+ * Allocate memory, taking small sizes straight from the thread cache
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the requested block of memory
+ */
+static inline void *tu_malloc_fast(size_t size) {
+    tu_histogram_record(size);
+    if (__builtin_expect(size <= TU_SMALL_MAX, 1)) {
+        return tu_alloc_class(tu_size_class(size), size);
+    }
+    return (tumalloc)(size);
+}
+
+/**
+ * Free memory, putting small heap blocks straight back in the thread cache
+ *
+ * Only blocks the page map places in the heap have their header read here;
+ * everything else, and anything that looks wrong, is left to tufree.
+ *
+ * @param ptr Pointer to the allocated piece of memory
+ */
+static inline void tu_free_fast(void *ptr) {
+    tu_span *span = tu_pagemap_get(ptr);
+    if (__builtin_expect(span != NULL && span->kind == TU_SPAN_HEAP, 1)) {
+        header *hdr = (header *) ptr - 1;
+        if (hdr->magic == TU_MAGIC && hdr->size <= TU_SMALL_MAX) {
+            unsigned cls = tu_size_class(hdr->size);
+            if (tu_class_size[cls] == hdr->size) {
+                hdr->magic = 0;
+                tu_free_class(ptr, cls);
+                return;
+            }
+        }
+    }
+    (tufree)(ptr);
+}
+
+/**
+ * Free memory of a known size, putting small blocks straight back in the thread cache
+ *
+ * The header's size must match the class of the size given, since realloc may
+ * have shrunk the block in place; anything else is left to tufree_sized.
+ *
+ * @param ptr Pointer to the allocated piece of memory, from tumalloc
+ * @param size The size that was asked for when it was allocated
+ */
+static inline void tu_free_sized_fast(void *ptr, size_t size) {
+    if (__builtin_expect(size <= TU_SMALL_MAX && ptr != NULL, 1)) {
+        // A private heap's blocks have the same header, so only the page map can tell them apart
+        tu_span *span = tu_pagemap_get(ptr);
+        header *hdr = (header *) ptr - 1;
+        unsigned cls = tu_size_class(size);
+        if (__builtin_expect(span != NULL && span->kind == TU_SPAN_HEAP && hdr->magic == TU_MAGIC &&
+                             hdr->size == tu_class_size[cls], 1)) {
+            hdr->magic = 0;
+            tu_free_class(ptr, cls);
+            return;
+        }
+    }
+    (tufree_sized)(ptr, size);
+}
+
+#if defined(TU_TRACE) && !defined(TU_TRACE_INTERNAL)
+int tumalloc_trace_start(const char *path);
+void tumalloc_trace_stop(void);
+void *tu_traced_malloc(size_t size);
+void *tu_traced_calloc(size_t num, size_t size);
+void *tu_traced_realloc(void *ptr, size_t new_size);
+void *tu_traced_memalign(size_t alignment, size_t size);
+void tu_traced_free(void *ptr);
+void tu_traced_free_sized(void *ptr, size_t size);
+
+/*
+ * A TU_TRACE build sends every call through the trace recorder in trace.c, which
+ * calls the functions in alloc.c and, while a trace runs, logs what they did.
+ */
+#define tumalloc(size) tu_traced_malloc(size)
+#define tucalloc(num, size) tu_traced_calloc(num, size)
+#define turealloc(ptr, new_size) tu_traced_realloc(ptr, new_size)
+#define tumemalign(alignment, size) tu_traced_memalign(alignment, size)
+#define tufree(ptr) tu_traced_free(ptr)
+#define tufree_sized(ptr, size) tu_traced_free_sized(ptr, size)
+#else
+/*
+ * Calls are routed to the inline fast paths above, so a hot loop inlines the
+ * allocator down to a cache pop or push; only misses call into alloc.c. Sizes
+ * known at compile time have their class looked up while compiling. Write
+ * (tumalloc), (tufree) or (tufree_sized) to call the functions directly.
+ */
+#define tumalloc(size) \
+    (__builtin_constant_p(size) && (size_t) (size) <= TU_SMALL_MAX \
+        ? (tu_histogram_record((size_t) (size)), tu_alloc_class(tu_size_class((size_t) (size)), (size_t) (size))) \
+        : tu_malloc_fast(size))
+#define tufree(ptr) tu_free_fast(ptr)
+#define tufree_sized(ptr, size) tu_free_sized_fast(ptr, size)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif //CYB3053_PROJECT2_ALLOC_H
@@ -252,8 +252,8 @@ int main(int argc, char** argv) {
         printf("%d\n", bigger_things[i]);
     }
 
-    // Free the allocated memory
-    tufree(more_things);
+    // Free the allocated memory; realloc already freed the old block
+    tufree(bigger_things);
 
     return 0;
 }
@@ -0,0 +1,184 @@
+#include "memkernels.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+/*
+ * Copy and zero kernels for big blocks. A multi-megabyte turealloc or tucalloc
+ * would otherwise stream the whole block through the cache and evict data the
+ * program is about to use, so above TU_NT_THRESHOLD the stores bypass the cache.
+ * Below it, libc is at least as fast and the data is likely read again soon.
+ */
+
+#ifdef HAVE_X86_KERNELS
+/**
+ * Copy memory with non-temporal AVX2 stores
+ *
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param size The number of bytes to copy
+ */
+__attribute__((target("avx2")))
+static void copy_avx2_nt(void *dst, const void *src, size_t size) {
+    char *d = dst;
+    const char *s = src;
+
+    // Streaming stores need an aligned destination, so copy up to the first 32 byte boundary normally
+    size_t head = (32 - ((uintptr_t) d & 31)) & 31;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    size -= head;
+
+    // Move 128 bytes per iteration so loads and stores can overlap
+    for (; size >= 128; size -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) s);
+        __m256i b = _mm256_loadu_si256((const __m256i *) (s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *) (s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *) (s + 96));
+        _mm256_stream_si256((__m256i *) d, a);
+        _mm256_stream_si256((__m256i *) (d + 32), b);
+        _mm256_stream_si256((__m256i *) (d + 64), c);
+        _mm256_stream_si256((__m256i *) (d + 96), e);
+    }
+
+    // Streaming stores are weakly ordered; fence before anyone can read the block
+    _mm_sfence();
+    memcpy(d, s, size);
+}
+
+/**
+ * Zero memory with non-temporal AVX2 stores
+ *
+ * @param dst The memory to zero
+ * @param size The number of bytes to zero
+ */
+__attribute__((target("avx2")))
+static void zero_avx2_nt(void *dst, size_t size) {
+    char *d = dst;
+
+    size_t head = (32 - ((uintptr_t) d & 31)) & 31;
+    memset(d, 0, head);
+    d += head;
+    size -= head;
+
+    __m256i zero = _mm256_setzero_si256();
+    for (; size >= 128; size -= 128, d += 128) {
+        _mm256_stream_si256((__m256i *) d, zero);
+        _mm256_stream_si256((__m256i *) (d + 32), zero);
+        _mm256_stream_si256((__m256i *) (d + 64), zero);
+        _mm256_stream_si256((__m256i *) (d + 96), zero);
+    }
+
+    _mm_sfence();
+    memset(d, 0, size);
+}
+#endif
+
+static void copy_resolve(void *dst, const void *src, size_t size);
+static void zero_resolve(void *dst, size_t size);
+
+/** The big-block copy in use, picked on the first call from what the CPU supports */
+static void (*copy_kernel)(void *, const void *, size_t) = copy_resolve;
+/** The big-block zeroing in use, picked on the first call from what the CPU supports */
+static void (*zero_kernel)(void *, size_t) = zero_resolve;
+
+/**
+ * Copy memory with libc
+ *
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param size The number of bytes to copy
+ */
+static void copy_libc(void *dst, const void *src, size_t size) {
+    memcpy(dst, src, size);
+}
+
+/**
+ * Zero memory with libc
+ *
+ * @param dst The memory to zero
+ * @param size The number of bytes to zero
+ */
+static void zero_libc(void *dst, size_t size) {
+    memset(dst, 0, size);
+}
+
+/**
+ * Check whether the CPU can run the AVX2 kernels
+ *
+ * @return Non-zero if AVX2 is available
+ */
+static int have_avx2(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Pick the big-block copy for this CPU, then run it
+ *
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param size The number of bytes to copy
+ */
+static void copy_resolve(void *dst, const void *src, size_t size) {
+    copy_kernel = copy_libc;
+#ifdef HAVE_X86_KERNELS
+    if (have_avx2())
+        copy_kernel = copy_avx2_nt;
+#endif
+    copy_kernel(dst, src, size);
+}
+
+/**
+ * Pick the big-block zeroing for this CPU, then run it
+ *
+ * @param dst The memory to zero
+ * @param size The number of bytes to zero
+ */
+static void zero_resolve(void *dst, size_t size) {
+    zero_kernel = zero_libc;
+#ifdef HAVE_X86_KERNELS
+    if (have_avx2())
+        zero_kernel = zero_avx2_nt;
+#endif
+    zero_kernel(dst, size);
+}
+
+/**
+ * Copy memory, bypassing the cache for big blocks
+ *
+ * @param dst Where to copy to
+ * @param src Where to copy from
+ * @param size The number of bytes to copy
+ */
+void tu_copy(void *dst, const void *src, size_t size) {
+    if (size < TU_NT_THRESHOLD) {
+        memcpy(dst, src, size);
+        return;
+    }
+    copy_kernel(dst, src, size);
+}
+
+/**
+ * Zero memory, bypassing the cache for big blocks
+ *
+ * @param dst The memory to zero
+ * @param size The number of bytes to zero
+ */
+void tu_zero(void *dst, size_t size) {
+    if (size < TU_NT_THRESHOLD) {
+        memset(dst, 0, size);
+        return;
+    }
+    zero_kernel(dst, size);
+}
@@ -0,0 +1,16 @@
+#ifndef CYB3053_PROJECT2_MEMKERNELS_H
+#define CYB3053_PROJECT2_MEMKERNELS_H
+
+#include <stddef.h>
+
+/**
+ * Copies at or above this many bytes bypass the cache with non-temporal stores
+ */
+#ifndef TU_NT_THRESHOLD
+#define TU_NT_THRESHOLD (1024 * 1024)
+#endif
+
+void tu_copy(void *dst, const void *src, size_t size);
+void tu_zero(void *dst, size_t size);
+
+#endif //CYB3053_PROJECT2_MEMKERNELS_H
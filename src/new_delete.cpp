@@ -0,0 +1,315 @@
+#include "alloc.h"
+
+#include <cstddef>
+#include <new>
+
+/*
+ * Replacements for every global operator new and delete, routing C++ allocations
+ * through tumalloc. Link the tumalloc_new_delete object library into a C++ target
+ * to use them. Sized deletes go to tufree_sized, which takes the size class from
+ * the size given and only checks it against the header, and the new-handler loop
+ * lives out of line so the fast path is one call and one test.
+ */
+
+namespace {
+
+/**
+ * Allocate with the right alignment
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, zero for the default
+ * @return A pointer to the block or nullptr
+ */
+inline void *try_alloc(std::size_t size, std::size_t alignment) {
+    return alignment == 0 ? tumalloc(size) : tumemalign(alignment, size);
+}
+
+/**
+ * Keep calling the new handler until an allocation succeeds
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, zero for the default
+ * @param nothrow Whether to return nullptr instead of throwing std::bad_alloc
+ * @return A pointer to the block, or nullptr if nothrow and memory ran out
+ */
+__attribute__((noinline, cold)) void *alloc_slow(std::size_t size, std::size_t alignment, bool nothrow) {
+    for (;;) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            if (nothrow) {
+                return nullptr;
+            }
+            throw std::bad_alloc();
+        }
+
+        // A handler that gives up throws std::bad_alloc, which nothrow callers turn into nullptr
+        if (nothrow) {
+            try {
+                handler();
+            } catch (...) {
+                return nullptr;
+            }
+        } else {
+            handler();
+        }
+
+        void *ptr = try_alloc(size, alignment);
+        if (ptr != nullptr) {
+            return ptr;
+        }
+    }
+}
+
+/**
+ * Allocate for a throwing operator new
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, zero for the default
+ * @return A pointer to the block
+ */
+inline void *alloc(std::size_t size, std::size_t alignment) {
+    void *ptr = try_alloc(size, alignment);
+    if (__builtin_expect(ptr != nullptr, 1)) {
+        return ptr;
+    }
+    return alloc_slow(size, alignment, false);
+}
+
+/**
+ * Allocate for a nothrow operator new
+ *
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, zero for the default
+ * @return A pointer to the block or nullptr
+ */
+inline void *alloc_nothrow(std::size_t size, std::size_t alignment) noexcept {
+    void *ptr = try_alloc(size, alignment);
+    if (__builtin_expect(ptr != nullptr, 1)) {
+        return ptr;
+    }
+    try {
+        return alloc_slow(size, alignment, true);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+/**
+ * Free a block whose size may be known
+ *
+ * @param ptr Pointer to the block
+ * @param size The size that was asked for
+ * @param alignment The alignment it was asked for with, zero for the default
+ */
+inline void free_sized(void *ptr, std::size_t size, std::size_t alignment) noexcept {
+    // Blocks moved up for alignment have an extra header only tufree knows to step over
+    if (alignment > alignof(std::max_align_t)) {
+        tufree(ptr);
+    } else {
+        tufree_sized(ptr, size);
+    }
+}
+
+} // namespace
+
+/**
+ * Allocate an object
+ *
+ * @param size The size of the object
+ * @return A pointer to the memory
+ */
+void *operator new(std::size_t size) {
+    return alloc(size, 0);
+}
+
+/**
+ * Allocate an array
+ *
+ * @param size The size of the array
+ * @return A pointer to the memory
+ */
+void *operator new[](std::size_t size) {
+    return alloc(size, 0);
+}
+
+/**
+ * Allocate an object without throwing
+ *
+ * @param size The size of the object
+ * @return A pointer to the memory or nullptr
+ */
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    return alloc_nothrow(size, 0);
+}
+
+/**
+ * Allocate an array without throwing
+ *
+ * @param size The size of the array
+ * @return A pointer to the memory or nullptr
+ */
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return alloc_nothrow(size, 0);
+}
+
+/**
+ * Allocate an over-aligned object
+ *
+ * @param size The size of the object
+ * @param alignment The alignment of the object
+ * @return A pointer to the memory
+ */
+void *operator new(std::size_t size, std::align_val_t alignment) {
+    return alloc(size, static_cast<std::size_t>(alignment));
+}
+
+/**
+ * Allocate an over-aligned array
+ *
+ * @param size The size of the array
+ * @param alignment The alignment of the elements
+ * @return A pointer to the memory
+ */
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+    return alloc(size, static_cast<std::size_t>(alignment));
+}
+
+/**
+ * Allocate an over-aligned object without throwing
+ *
+ * @param size The size of the object
+ * @param alignment The alignment of the object
+ * @return A pointer to the memory or nullptr
+ */
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return alloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+/**
+ * Allocate an over-aligned array without throwing
+ *
+ * @param size The size of the array
+ * @param alignment The alignment of the elements
+ * @return A pointer to the memory or nullptr
+ */
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+    return alloc_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+/**
+ * Free an object
+ *
+ * @param ptr Pointer to the object, or nullptr
+ */
+void operator delete(void *ptr) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an array
+ *
+ * @param ptr Pointer to the array, or nullptr
+ */
+void operator delete[](void *ptr) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an object allocated without throwing
+ *
+ * @param ptr Pointer to the object, or nullptr
+ */
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an array allocated without throwing
+ *
+ * @param ptr Pointer to the array, or nullptr
+ */
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an object of known size
+ *
+ * @param ptr Pointer to the object, or nullptr
+ * @param size The size of the object
+ */
+void operator delete(void *ptr, std::size_t size) noexcept {
+    tufree_sized(ptr, size);
+}
+
+/**
+ * Free an array of known size
+ *
+ * @param ptr Pointer to the array, or nullptr
+ * @param size The size the array was allocated with
+ */
+void operator delete[](void *ptr, std::size_t size) noexcept {
+    tufree_sized(ptr, size);
+}
+
+/**
+ * Free an over-aligned object
+ *
+ * @param ptr Pointer to the object, or nullptr
+ * @param alignment The alignment of the object
+ */
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an over-aligned array
+ *
+ * @param ptr Pointer to the array, or nullptr
+ * @param alignment The alignment of the elements
+ */
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an over-aligned object allocated without throwing
+ *
+ * @param ptr Pointer to the object, or nullptr
+ * @param alignment The alignment of the object
+ */
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an over-aligned array allocated without throwing
+ *
+ * @param ptr Pointer to the array, or nullptr
+ * @param alignment The alignment of the elements
+ */
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept {
+    tufree(ptr);
+}
+
+/**
+ * Free an over-aligned object of known size
+ *
+ * @param ptr Pointer to the object, or nullptr
+ * @param size The size of the object
+ * @param alignment The alignment of the object
+ */
+void operator delete(void *ptr, std::size_t size, std::align_val_t alignment) noexcept {
+    free_sized(ptr, size, static_cast<std::size_t>(alignment));
+}
+
+/**
+ * Free an over-aligned array of known size
+ *
+ * @param ptr Pointer to the array, or nullptr
+ * @param size The size the array was allocated with
+ * @param alignment The alignment of the elements
+ */
+void operator delete[](void *ptr, std::size_t size, std::align_val_t alignment) noexcept {
+    free_sized(ptr, size, static_cast<std::size_t>(alignment));
+}
@@ -0,0 +1,135 @@
+#include "output.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/**
+ * Start output to a file descriptor
+ *
+ * @param out The output
+ * @param fd The file descriptor
+ * @param socket Whether fd is a socket
+ */
+void tu_out_init(tu_out *out, int fd, int socket) {
+    out->fd = fd;
+    out->socket = socket;
+    out->error = 0;
+    out->used = 0;
+}
+
+/**
+ * Write out everything buffered
+ *
+ * @param out The output
+ * @return 0 if everything so far was written, -1 after a write error
+ */
+int tu_out_flush(tu_out *out) {
+    const char *data = out->data;
+    size_t length = out->used;
+    out->used = 0;
+    while (length > 0 && !out->error) {
+        // A client hanging up must not kill the process
+        ssize_t written = out->socket ? send(out->fd, data, length, MSG_NOSIGNAL) : write(out->fd, data, length);
+        if (written <= 0) {
+            out->error = 1;
+            break;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+    return out->error ? -1 : 0;
+}
+
+/**
+ * Append bytes to the output
+ *
+ * @param out The output
+ * @param data The bytes
+ * @param length The number of bytes
+ */
+void tu_out_write(tu_out *out, const char *data, size_t length) {
+    while (length > 0) {
+        if (out->used == TU_OUT_BUFFER_SIZE) {
+            tu_out_flush(out);
+        }
+        size_t chunk = TU_OUT_BUFFER_SIZE - out->used;
+        if (chunk > length) {
+            chunk = length;
+        }
+        memcpy(out->data + out->used, data, chunk);
+        out->used += chunk;
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Append formatted text to the output
+ *
+ * @param out The output
+ * @param format A printf format, for at most TU_OUT_LINE_MAX bytes of text; more is cut off
+ */
+void tu_out_printf(tu_out *out, const char *format, ...) {
+    // Make sure a whole line fits before formatting it
+    if (TU_OUT_BUFFER_SIZE - out->used < TU_OUT_LINE_MAX) {
+        tu_out_flush(out);
+    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(out->data + out->used, TU_OUT_BUFFER_SIZE - out->used, format, args);
+    va_end(args);
+    if (length > 0) {
+        size_t room = TU_OUT_BUFFER_SIZE - out->used - 1;
+        out->used += (size_t) length < room ? (size_t) length : room;
+    }
+}
+
+/**
+ * Expand a file name from the environment into a path
+ *
+ * A %p in the name is replaced by the process ID, so that every process of a
+ * preloaded pipeline gets a file of its own.
+ *
+ * @param path Filled with the path, cut off if it does not fit
+ * @param size The size of path
+ * @param name The name
+ */
+void tu_expand_path(char *path, size_t size, const char *name) {
+    const char *pid = strstr(name, "%p");
+    if (pid != NULL) {
+        snprintf(path, size, "%.*s%ld%s", (int) (pid - name), name, (long) getpid(), pid + 2);
+    } else {
+        snprintf(path, size, "%s", name);
+    }
+}
+
+/**
+ * Read the resident set size of the process
+ *
+ * @return Bytes resident, or 0 if /proc could not be read
+ */
+size_t tu_resident_bytes(void) {
+    // Read with plain system calls, since stdio would allocate from the allocator being measured
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    char text[128];
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    text[length] = '\0';
+
+    // The second field counts resident pages
+    unsigned long long pages = 0;
+    if (sscanf(text, "%*s %llu", &pages) != 1) {
+        return 0;
+    }
+    return (size_t) pages * (size_t) sysconf(_SC_PAGESIZE);
+}
@@ -0,0 +1,30 @@
+#ifndef CYB3053_PROJECT2_OUTPUT_H
+#define CYB3053_PROJECT2_OUTPUT_H
+
+#include <stddef.h>
+
+#define TU_OUT_BUFFER_SIZE 4096 /**< Bytes of output gathered before each write */
+#define TU_OUT_LINE_MAX 256 /**< Longest piece of text tu_out_printf is sure to fit */
+
+/**
+ * Output buffered on its way to a file descriptor
+ *
+ * Reports are formatted into this buffer, on the stack, so writing them never
+ * allocates and works even while the heap is in trouble.
+ */
+typedef struct tu_out {
+    int fd; /**< Where the output goes */
+    int socket; /**< Whether fd is a socket, written to without raising SIGPIPE */
+    int error; /**< Set once a write has failed; later output is dropped */
+    size_t used; /**< Bytes of data waiting to be written */
+    char data[TU_OUT_BUFFER_SIZE]; /**< Output not yet written */
+} tu_out;
+
+void tu_out_init(tu_out *out, int fd, int socket);
+void tu_out_write(tu_out *out, const char *data, size_t length);
+void tu_out_printf(tu_out *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int tu_out_flush(tu_out *out);
+void tu_expand_path(char *path, size_t size, const char *name);
+size_t tu_resident_bytes(void);
+
+#endif //CYB3053_PROJECT2_OUTPUT_H
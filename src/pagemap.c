@@ -0,0 +1,95 @@
+#include "pagemap.h"
+
+#include <sys/mman.h>
+
+#define SPAN_CHUNK (64 * 1024) /**< Bytes of span descriptors mapped at a time */
+#define LEAF_SIZE (sizeof(tu_span *) << TU_PAGEMAP_LEAF_BITS) /**< Bytes in one leaf of the page map */
+
+/*
+ * The page map is a two level radix tree over the page numbers of the 48-bit
+ * address space. The root lives in zero-filled static storage, so only the parts
+ * that are looked at get committed, and leaves are mapped the first time a page
+ * they cover is set. Span descriptors come from their own mappings and are
+ * recycled through a free list, so none of this metadata touches the heap.
+ * Everything here except lookups runs under the allocator lock; lookups take
+ * none, so entries are written with release stores and read with acquire loads.
+ */
+tu_span **tu_pagemap_root[(size_t) 1 << TU_PAGEMAP_ROOT_BITS];
+
+static tu_span *FREE_SPANS = NULL; /**< Span descriptors ready for reuse */
+static size_t MAPPED_BYTES = 0; /**< Bytes mapped for leaves and span descriptors */
+
+/**
+ * Get a span descriptor
+ *
+ * @return A zeroed span descriptor or NULL if no memory could be mapped
+ */
+tu_span *tu_span_new(void) {
+    if (FREE_SPANS == NULL) {
+        tu_span *chunk = mmap(NULL, SPAN_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        MAPPED_BYTES += SPAN_CHUNK;
+        for (size_t i = 0; i < SPAN_CHUNK / sizeof(tu_span); i++) {
+            chunk[i].next = FREE_SPANS;
+            FREE_SPANS = &chunk[i];
+        }
+    }
+
+    tu_span *span = FREE_SPANS;
+    FREE_SPANS = span->next;
+    *span = (tu_span) {0};
+    return span;
+}
+
+/**
+ * Give a span descriptor back for reuse
+ *
+ * @param span The span descriptor
+ */
+void tu_span_delete(tu_span *span) {
+    span->next = FREE_SPANS;
+    FREE_SPANS = span;
+}
+
+/**
+ * Point every page of a run at a span
+ *
+ * @param start The first byte of the run; it need not be page aligned
+ * @param npages The number of pages in the run
+ * @param span The span, or NULL to forget the pages
+ * @return 0 on success, -1 if a leaf could not be mapped
+ */
+int tu_pagemap_set(const void *start, size_t npages, tu_span *span) {
+    uintptr_t page = (uintptr_t) start >> TU_PAGE_SHIFT;
+    uintptr_t leaf_mask = ((uintptr_t) 1 << TU_PAGEMAP_LEAF_BITS) - 1;
+
+    for (size_t i = 0; i < npages; i++, page++) {
+        tu_span ***slot = &tu_pagemap_root[page >> TU_PAGEMAP_LEAF_BITS];
+        if (*slot == NULL) {
+            // Clearing pages never needs a leaf that does not exist yet
+            if (span == NULL) {
+                continue;
+            }
+            tu_span **leaf = mmap(NULL, LEAF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (leaf == MAP_FAILED) {
+                return -1;
+            }
+            MAPPED_BYTES += LEAF_SIZE;
+            // Lookups run without the allocator lock, so the leaf is published only once it is zeroed
+            __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&(*slot)[page & leaf_mask], span, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/**
+ * Count the memory the page map and span descriptors take up
+ *
+ * @return Bytes mapped for leaves and span descriptors
+ */
+size_t tu_pagemap_metadata(void) {
+    return MAPPED_BYTES;
+}
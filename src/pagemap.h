@@ -0,0 +1,73 @@
+#ifndef CYB3053_PROJECT2_PAGEMAP_H
+#define CYB3053_PROJECT2_PAGEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pages.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TU_ADDRESS_BITS 48 /**< Bits of virtual address the page map covers */
+#define TU_PAGEMAP_LEAF_BITS 18 /**< Bits of the page number resolved by a leaf of the page map */
+#define TU_PAGEMAP_ROOT_BITS (TU_ADDRESS_BITS - TU_PAGE_SHIFT - TU_PAGEMAP_LEAF_BITS) /**< Bits resolved by the root */
+
+/**
+ * Kinds of span
+ */
+enum tu_span_kind {
+    TU_SPAN_HEAP = 1, /**< Pages of the sbrk heap, holding blocks with in-band headers */
+    TU_SPAN_LARGE = 2, /**< A run of pages holding one header-less large block */
+    TU_SPAN_ARENA = 3, /**< A run of pages belonging to a tu_heap, holding blocks with in-band headers */
+    TU_SPAN_SAMPLED = 4, /**< A run of pages holding one allocation sampled by the heap profiler, after a header */
+};
+
+/**
+ * Span descriptor, describing a run of pages and what they hold
+ */
+typedef struct tu_span {
+    char *start; /**< First byte of the span */
+    size_t npages; /**< Number of pages in the span */
+    size_t size; /**< Usable size of the block in a large span */
+    int kind; /**< What the span holds, one of tu_span_kind */
+    struct tu_span *next; /**< Next span on a list of spans */
+    struct tu_span *prev; /**< Previous span on a doubly linked list of spans */
+    void *owner; /**< The tu_heap an arena span belongs to, or the profile bucket of a sampled span */
+} tu_span;
+
+/**
+ * Root of the page map: for each group of pages, the leaf mapping those pages to spans
+ */
+extern tu_span **tu_pagemap_root[(size_t) 1 << TU_PAGEMAP_ROOT_BITS];
+
+tu_span *tu_span_new(void);
+void tu_span_delete(tu_span *span);
+int tu_pagemap_set(const void *start, size_t npages, tu_span *span);
+size_t tu_pagemap_metadata(void);
+
+/**
+ * Look up the span an address belongs to
+ *
+ * Any address can be looked up, including ones the allocator never handed out;
+ * it costs two dependent loads and never touches the memory being asked about.
+ * It takes no lock, so it is safe to call while another thread updates the map.
+ *
+ * @param ptr The address
+ * @return The span or NULL if the address is not in one
+ */
+static inline tu_span *tu_pagemap_get(const void *ptr) {
+    uintptr_t page = (uintptr_t) ptr >> TU_PAGE_SHIFT;
+    if (page >> (TU_PAGEMAP_ROOT_BITS + TU_PAGEMAP_LEAF_BITS)) {
+        return NULL;
+    }
+    tu_span **leaf = __atomic_load_n(&tu_pagemap_root[page >> TU_PAGEMAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    return leaf != NULL ? __atomic_load_n(&leaf[page & (((uintptr_t) 1 << TU_PAGEMAP_LEAF_BITS) - 1)], __ATOMIC_ACQUIRE) : NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CYB3053_PROJECT2_PAGEMAP_H
@@ -0,0 +1,426 @@
+#include "pages.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define REGION_MAX_SHIFT 34 /**< log2 of the most address space the page allocator reserves (16 GiB) */
+#define REGION_MIN_SHIFT 26 /**< log2 of the least address space worth reserving (64 MiB) */
+#define MAX_PAGES ((size_t) 1 << (REGION_MAX_SHIFT - TU_PAGE_SHIFT)) /**< Pages in the largest region */
+#define MAX_WORDS (MAX_PAGES / 64) /**< Bitmap words covering the largest region */
+#define NO_PAGE ((size_t) -1) /**< Page returned when no run is free */
+#define DIRTY_RUNS 64 /**< Most freed runs remembered before their pages are decommitted */
+#define DIRTY_MAX_PAGES 8192 /**< Most free pages (32 MiB) kept committed before they are decommitted */
+
+/*
+ * The page allocator hands out runs of pages from one big reservation, tracked by
+ * a three level bitmap. USED has a bit per page. Each bit of FULL and BUSY stands
+ * for one word of USED: FULL when all 64 pages are in use, BUSY when any is. Each
+ * bit of FULL_GROUPS stands for one word of FULL, set when that word is all ones.
+ * A set bit always means "in use", so the zero-filled bitmaps start out all free.
+ *
+ * Runs of up to 64 pages are found by descending FULL_GROUPS and FULL to words
+ * with room, then testing the word with shifts and tzcnt. Longer runs must cover
+ * whole free words, which show up as zero bits of BUSY.
+ */
+static uint64_t USED[MAX_WORDS]; /**< One bit per page, set when the page is in use */
+static uint64_t FULL[MAX_WORDS / 64]; /**< One bit per USED word, set when all its pages are in use */
+static uint64_t BUSY[MAX_WORDS / 64]; /**< One bit per USED word, set when any of its pages is in use */
+static uint64_t FULL_GROUPS[MAX_WORDS / 64 / 64]; /**< One bit per FULL word, set when it is all ones */
+
+static char *REGION = NULL; /**< First byte of the reserved region */
+static size_t REGION_WORDS = 0; /**< Number of USED words covering the region */
+static int REGION_STATE = 0; /**< 0 before the region is reserved, 1 once it is, -1 if it could not be */
+static size_t PAGES_USED = 0; /**< Number of pages handed out and not yet freed */
+
+/*
+ * Freed runs stay committed, so a run handed out again right away does not fault.
+ * DIRTY has a bit per free page that is still committed, and every such page lies
+ * in one of the runs remembered since the last purge. Once too many pages are
+ * dirty, or too many runs were freed, the purge decommits whatever of those runs
+ * is still free.
+ */
+static uint64_t DIRTY[MAX_WORDS]; /**< One bit per page, set when the page is free but still committed */
+static size_t DIRTY_PAGES = 0; /**< Number of bits set in DIRTY */
+static size_t DIRTY_STARTS[DIRTY_RUNS]; /**< First page of each run freed since the last purge */
+static size_t DIRTY_LENGTHS[DIRTY_RUNS]; /**< Number of pages of each run freed since the last purge */
+static size_t DIRTY_COUNT = 0; /**< Number of runs freed since the last purge */
+
+/*
+ * One lock guards all allocator state: the sbrk heap and its free index, the page
+ * allocator, the page map's updates and the span pool. The thread holding it is
+ * remembered so that a thread reentering the allocator is told so instead of
+ * deadlocking on itself.
+ */
+static pthread_mutex_t ALLOC_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Lock guarding all allocator state */
+static pthread_t LOCK_OWNER = 0; /**< Thread holding ALLOC_LOCK, zero when it is free */
+static int FORK_HANDLERS = 0; /**< Whether the fork handlers have been registered */
+
+/**
+ * Reserve the region the page allocator carves runs from
+ *
+ * The region is reserved without backing; pages are committed by the kernel the
+ * first time they are touched and decommitted again some time after they are freed.
+ *
+ * @return 0 on success, -1 if no region could be reserved
+ */
+static int reserve_region(void) {
+    if (REGION_STATE != 0) {
+        return REGION_STATE > 0 ? 0 : -1;
+    }
+
+    // Ask for the most address space first and settle for less if the system refuses
+    for (int shift = REGION_MAX_SHIFT; shift >= REGION_MIN_SHIFT; shift--) {
+        void *region = mmap(NULL, (size_t) 1 << shift, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region != MAP_FAILED) {
+            REGION = region;
+            REGION_WORDS = ((size_t) 1 << (shift - TU_PAGE_SHIFT)) / 64;
+            REGION_STATE = 1;
+            return 0;
+        }
+    }
+    REGION_STATE = -1;
+    return -1;
+}
+
+/**
+ * Refresh the summary bits for one word of the page bitmap
+ *
+ * @param word The index of the USED word that changed
+ */
+static void update_summaries(size_t word) {
+    size_t group = word / 64;
+    uint64_t bit = (uint64_t) 1 << (word % 64);
+
+    if (USED[word] == ~(uint64_t) 0)
+        FULL[group] |= bit;
+    else
+        FULL[group] &= ~bit;
+
+    if (USED[word] != 0)
+        BUSY[group] |= bit;
+    else
+        BUSY[group] &= ~bit;
+
+    uint64_t group_bit = (uint64_t) 1 << (group % 64);
+    if (FULL[group] == ~(uint64_t) 0)
+        FULL_GROUPS[group / 64] |= group_bit;
+    else
+        FULL_GROUPS[group / 64] &= ~group_bit;
+}
+
+/**
+ * Mark a run of pages used or free
+ *
+ * @param page The first page of the run
+ * @param npages The number of pages in the run
+ * @param used Non-zero to mark the pages used, zero to mark them free
+ */
+static void mark_pages(size_t page, size_t npages, int used) {
+    while (npages != 0) {
+        size_t word = page / 64;
+        size_t bit = page % 64;
+        size_t count = 64 - bit < npages ? 64 - bit : npages;
+        uint64_t mask = (count == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << count) - 1)) << bit;
+
+        if (used)
+            USED[word] |= mask;
+        else
+            USED[word] &= ~mask;
+        update_summaries(word);
+
+        page += count;
+        npages -= count;
+    }
+}
+
+/**
+ * Mark a run of pages dirty or clean
+ *
+ * @param page The first page of the run
+ * @param npages The number of pages in the run
+ * @param dirty Non-zero to mark the pages dirty, zero to mark them clean
+ * @return The number of pages whose state changed
+ */
+static size_t mark_dirty(size_t page, size_t npages, int dirty) {
+    size_t changed = 0;
+    while (npages != 0) {
+        size_t word = page / 64;
+        size_t bit = page % 64;
+        size_t count = 64 - bit < npages ? 64 - bit : npages;
+        uint64_t mask = (count == 64 ? ~(uint64_t) 0 : (((uint64_t) 1 << count) - 1)) << bit;
+
+        uint64_t old = DIRTY[word];
+        DIRTY[word] = dirty ? old | mask : old & ~mask;
+        changed += (size_t) __builtin_popcountll(old ^ DIRTY[word]);
+
+        page += count;
+        npages -= count;
+    }
+    return changed;
+}
+
+/**
+ * Decommit the dirty pages of every run freed since the last purge
+ */
+static void purge_dirty(void) {
+    for (size_t i = 0; i < DIRTY_COUNT; i++) {
+        size_t page = DIRTY_STARTS[i];
+        size_t end = page + DIRTY_LENGTHS[i];
+
+        // Parts of the run may have been handed out again; those are clean and skipped
+        while (page < end) {
+            while (page < end && !(DIRTY[page / 64] >> (page % 64) & 1))
+                page++;
+            size_t first = page;
+            while (page < end && (DIRTY[page / 64] >> (page % 64) & 1))
+                page++;
+            if (page != first) {
+                madvise(REGION + (first << TU_PAGE_SHIFT), (page - first) << TU_PAGE_SHIFT, MADV_DONTNEED);
+                DIRTY_PAGES -= mark_dirty(first, page - first, 0);
+            }
+        }
+    }
+    DIRTY_COUNT = 0;
+}
+
+/**
+ * Find where runs of set bits start in a word
+ *
+ * @param bits The word
+ * @param n The length of the run, at most 64
+ * @return A word with bit i set when bits i to i + n - 1 of the input are all set
+ */
+static uint64_t run_starts(uint64_t bits, size_t n) {
+    // Each step doubles the length of run every surviving bit stands for
+    size_t have = 1;
+    while (have < n && bits != 0) {
+        size_t shift = have < n - have ? have : n - have;
+        bits &= bits >> shift;
+        have += shift;
+    }
+    return bits;
+}
+
+/**
+ * Count the free pages at the top of a word of the bitmap
+ *
+ * @param used The USED word
+ * @return The number of free pages above the highest page in use
+ */
+static size_t free_above(uint64_t used) {
+    return used == 0 ? 64 : (size_t) __builtin_clzll(used);
+}
+
+/**
+ * Count the free pages at the bottom of a word of the bitmap
+ *
+ * @param used The USED word
+ * @return The number of free pages below the lowest page in use
+ */
+static size_t free_below(uint64_t used) {
+    return used == 0 ? 64 : (size_t) __builtin_ctzll(used);
+}
+
+/**
+ * Find the lowest run of pages that lies within one word or straddles two
+ *
+ * @param npages The number of pages, at most 128
+ * @return The first page of the run or NO_PAGE
+ */
+static size_t find_short_run(size_t npages) {
+    size_t groups = REGION_WORDS / 64;
+
+    // Descend through the summaries to the words that are not completely used
+    for (size_t top = 0; top * 64 < groups; top++) {
+        uint64_t open_groups = ~FULL_GROUPS[top];
+        while (open_groups != 0) {
+            size_t group = top * 64 + (size_t) __builtin_ctzll(open_groups);
+            open_groups &= open_groups - 1;
+            if (group >= groups)
+                return NO_PAGE;
+
+            uint64_t open_words = ~FULL[group];
+            while (open_words != 0) {
+                size_t word = group * 64 + (size_t) __builtin_ctzll(open_words);
+                open_words &= open_words - 1;
+
+                // A run inside the word comes first, since it starts lower than one that straddles
+                if (npages <= 64) {
+                    uint64_t starts = run_starts(~USED[word], npages);
+                    if (starts != 0)
+                        return word * 64 + (size_t) __builtin_ctzll(starts);
+                }
+
+                // Otherwise a run can start in the top of this word and finish in the next
+                size_t above = free_above(USED[word]);
+                if (above != 0 && word + 1 < REGION_WORDS && above + free_below(USED[word + 1]) >= npages)
+                    return word * 64 + 64 - above;
+            }
+        }
+    }
+    return NO_PAGE;
+}
+
+/**
+ * Find the lowest run of pages that covers at least one whole free word
+ *
+ * @param npages The number of pages
+ * @return The first page of the run or NO_PAGE
+ */
+static size_t find_long_run(size_t npages) {
+    size_t groups = REGION_WORDS / 64;
+    size_t word = 0;
+
+    while (word < REGION_WORDS) {
+        // Find the next completely free word
+        size_t group = word / 64;
+        uint64_t idle = ~BUSY[group] & (~(uint64_t) 0 << (word % 64));
+        while (idle == 0) {
+            if (++group >= groups)
+                return NO_PAGE;
+            idle = ~BUSY[group];
+        }
+        size_t first = group * 64 + (size_t) __builtin_ctzll(idle);
+
+        // Find where the stretch of free words ends
+        uint64_t busy = BUSY[group] & (~(uint64_t) 0 << (first % 64));
+        while (busy == 0 && ++group < groups) {
+            busy = BUSY[group];
+        }
+        size_t last = busy != 0 ? group * 64 + (size_t) __builtin_ctzll(busy) : REGION_WORDS;
+
+        // The run can also use the free top of the word before and the free bottom of the word after
+        size_t above = first > 0 ? free_above(USED[first - 1]) : 0;
+        size_t below = last < REGION_WORDS ? free_below(USED[last]) : 0;
+        if (above + 64 * (last - first) + below >= npages)
+            return first * 64 - above;
+
+        word = last + 1;
+    }
+    return NO_PAGE;
+}
+
+/**
+ * Allocate a run of pages
+ *
+ * @param npages The number of pages
+ * @return A pointer to the first page or NULL if no run is free
+ */
+void *tu_pages_alloc(size_t npages) {
+    if (npages == 0 || reserve_region() != 0) {
+        return NULL;
+    }
+
+    size_t page = npages <= 64 ? find_short_run(npages) : find_long_run(npages);
+    if (page == NO_PAGE && npages > 64 && npages < 128) {
+        page = find_short_run(npages);
+    }
+    if (page == NO_PAGE) {
+        return NULL;
+    }
+
+    mark_pages(page, npages, 1);
+    DIRTY_PAGES -= mark_dirty(page, npages, 0);
+    PAGES_USED += npages;
+    return REGION + (page << TU_PAGE_SHIFT);
+}
+
+/**
+ * Free a run of pages, decommitting them once enough freed pages pile up
+ *
+ * @param start A pointer to the first page of the run
+ * @param npages The number of pages
+ */
+void tu_pages_free(void *start, size_t npages) {
+    size_t page = (size_t) ((char *) start - REGION) >> TU_PAGE_SHIFT;
+    mark_pages(page, npages, 0);
+    PAGES_USED -= npages;
+
+    DIRTY_PAGES += mark_dirty(page, npages, 1);
+    DIRTY_STARTS[DIRTY_COUNT] = page;
+    DIRTY_LENGTHS[DIRTY_COUNT] = npages;
+    DIRTY_COUNT++;
+    if (DIRTY_PAGES > DIRTY_MAX_PAGES || DIRTY_COUNT == DIRTY_RUNS) {
+        purge_dirty();
+    }
+}
+
+/**
+ * Count the pages handed out and not yet freed
+ *
+ * @return The number of pages in use
+ */
+size_t tu_pages_used(void) {
+    return PAGES_USED;
+}
+
+/**
+ * Check whether a pointer lies in the page allocator's region
+ *
+ * @param ptr The pointer
+ * @return Non-zero if the pointer is inside the region
+ */
+int tu_pages_owns(const void *ptr) {
+    return REGION != NULL && (const char *) ptr >= REGION &&
+           (size_t) ((const char *) ptr - REGION) < (REGION_WORDS * 64) << TU_PAGE_SHIFT;
+}
+
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+/**
+ * Take the allocator lock
+ *
+ * The first time through, this also registers the fork handlers, while holding
+ * the lock so that any allocation they make is caught as reentrant.
+ *
+ * @return 0 if the lock was taken, -1 if this thread already holds it
+ */
+int tu_lock(void) {
+    pthread_t self = pthread_self();
+    if (__atomic_load_n(&LOCK_OWNER, __ATOMIC_RELAXED) == self) {
+        return -1;
+    }
+    pthread_mutex_lock(&ALLOC_LOCK);
+    __atomic_store_n(&LOCK_OWNER, self, __ATOMIC_RELAXED);
+
+    if (!FORK_HANDLERS) {
+        FORK_HANDLERS = 1;
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+    }
+    return 0;
+}
+
+/**
+ * Release the allocator lock
+ */
+void tu_unlock(void) {
+    __atomic_store_n(&LOCK_OWNER, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ALLOC_LOCK);
+}
+
+/**
+ * Take the allocator lock before fork, so the child never sees the heap half updated
+ */
+static void fork_prepare(void) {
+    tu_lock();
+}
+
+/**
+ * Release the allocator lock in the parent after fork
+ */
+static void fork_parent(void) {
+    tu_unlock();
+}
+
+/**
+ * Release the allocator lock in the child after fork
+ *
+ * The child's only thread is the one that forked, so it owns the copied lock.
+ */
+static void fork_child(void) {
+    tu_unlock();
+}
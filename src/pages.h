@@ -0,0 +1,24 @@
+#ifndef CYB3053_PROJECT2_PAGES_H
+#define CYB3053_PROJECT2_PAGES_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TU_PAGE_SHIFT 12 /**< log2 of the size of the pages the page allocator hands out */
+#define TU_PAGE_SIZE ((size_t) 1 << TU_PAGE_SHIFT) /**< Size of the pages the page allocator hands out */
+
+void *tu_pages_alloc(size_t npages);
+void tu_pages_free(void *start, size_t npages);
+int tu_pages_owns(const void *ptr);
+size_t tu_pages_used(void);
+int tu_lock(void);
+void tu_unlock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //CYB3053_PROJECT2_PAGES_H
@@ -0,0 +1,176 @@
+#include "alloc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * The standard allocation functions, defined on top of the tu* ones so that
+ * libtumalloc.so can be preloaded into a program to replace its allocator:
+ *
+ *     LD_PRELOAD=./libtumalloc.so ./program
+ *
+ * The C library calls these through its own exported symbols, so it allocates
+ * from tumalloc as well. None of them allocate on the way in, and the allocator
+ * itself takes care of being reentered, so they are safe to call from the first
+ * instruction of the process.
+ */
+
+#define TU_EXPORT __attribute__((visibility("default"))) /**< Keep a symbol visible whatever the build's default */
+
+/**
+ * Allocate memory
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL with errno set
+ */
+TU_EXPORT void *malloc(size_t size) {
+    void *ptr = tumalloc(size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Free memory
+ *
+ * @param ptr A pointer to the block, or NULL
+ */
+TU_EXPORT void free(void *ptr) {
+    tufree(ptr);
+}
+
+/**
+ * Allocate zeroed memory for an array
+ *
+ * Unlike tucalloc, an empty array still gets a unique block, as glibc's calloc does.
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the zeroed block or NULL with errno set
+ */
+TU_EXPORT void *calloc(size_t num, size_t size) {
+    void *ptr = (num == 0 || size == 0) ? tumalloc(0) : tucalloc(num, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Resize memory
+ *
+ * @param ptr A pointer to the block, or NULL
+ * @param size The new size; zero frees the block
+ * @return A pointer to the resized block, or NULL with errno set and the old block untouched
+ */
+TU_EXPORT void *realloc(void *ptr, size_t size) {
+    void *new_ptr = turealloc(ptr, size);
+    if (new_ptr == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    return new_ptr;
+}
+
+/**
+ * Resize memory for an array
+ *
+ * @param ptr A pointer to the block, or NULL
+ * @param num How many elements the array should hold
+ * @param size The size of each element
+ * @return A pointer to the resized block, or NULL with errno set
+ */
+TU_EXPORT void *reallocarray(void *ptr, size_t num, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(num, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+/**
+ * Allocate aligned memory, POSIX style
+ *
+ * @param out Set to the block on success
+ * @param alignment The alignment, a power of two multiple of sizeof(void *)
+ * @param size The amount of memory to allocate
+ * @return 0 on success, EINVAL for a bad alignment or ENOMEM
+ */
+TU_EXPORT int posix_memalign(void **out, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+    void *ptr = tumemalign(alignment, size);
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+/**
+ * Allocate aligned memory, C11 style
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL with errno set
+ */
+TU_EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    void *ptr = tumemalign(alignment, size);
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+/**
+ * Allocate aligned memory, the obsolete way
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL with errno set
+ */
+TU_EXPORT void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+/**
+ * Allocate page-aligned memory
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL with errno set
+ */
+TU_EXPORT void *valloc(size_t size) {
+    return aligned_alloc((size_t) sysconf(_SC_PAGESIZE), size);
+}
+
+/**
+ * Allocate page-aligned memory, rounded up to whole pages
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block or NULL with errno set
+ */
+TU_EXPORT void *pvalloc(size_t size) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+/**
+ * Find how many bytes a block can hold
+ *
+ * @param ptr A pointer to the block, or NULL
+ * @return The usable size of the block
+ */
+TU_EXPORT size_t malloc_usable_size(void *ptr) {
+    return tumalloc_usable_size(ptr);
+}
@@ -0,0 +1,277 @@
+#include "alloc.h"
+#include "output.h"
+#include "profile.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define BUCKET_TABLE_SIZE 4096 /**< Hash chains of buckets, a power of two */
+#define BUCKET_CHUNK (64 * 1024) /**< Bytes of buckets mapped at a time */
+#define IDLE_INTERVAL (1024 * 1024) /**< Bytes a thread allocates between checks for a new rate while sampling is off */
+
+/*
+ * The heap profiler samples about one allocation in every PROFILE_RATE bytes.
+ * Each thread counts down the bytes it allocates, and the allocation that takes
+ * the count below zero is sampled; the next count is drawn from an exponential
+ * distribution, so every byte is equally likely to be sampled and a sample
+ * stands for rate / (1 - e^(-size / rate)) bytes. Sampled blocks get pages of
+ * their own, so the free fast path never has to look for them.
+ *
+ * Samples are counted in one bucket per distinct stack. Buckets are never freed,
+ * so a profile can be dumped without the allocator lock while threads go on
+ * allocating. The dump is in the legacy heap_v2 text format that pprof reads,
+ * with in-use and cumulative counts side by side.
+ */
+struct tu_profile_bucket {
+    uint64_t hash; /**< Hash of the stack */
+    int depth; /**< Number of frames in the stack */
+    void *stack[TU_PROFILE_DEPTH]; /**< Return addresses, innermost first */
+    uint64_t allocs; /**< Sampled allocations made at the stack */
+    uint64_t alloc_bytes; /**< Bytes of the sampled allocations */
+    uint64_t frees; /**< Sampled allocations since freed */
+    uint64_t free_bytes; /**< Bytes of the sampled allocations since freed */
+    tu_profile_bucket *next; /**< Next bucket in the same hash chain */
+    tu_profile_bucket *all; /**< Next bucket in the list of every bucket */
+};
+
+static size_t PROFILE_RATE = 0; /**< Mean bytes between samples, zero when sampling is off */
+static size_t DUMP_RATE = 0; /**< Last non-zero rate, which the samples so far were taken at */
+static tu_profile_bucket *TABLE[BUCKET_TABLE_SIZE]; /**< Hash chains of buckets, changed under the allocator lock */
+static tu_profile_bucket *BUCKETS = NULL; /**< Every bucket, newest first; read without the lock */
+static char *POOL = NULL; /**< Unused bytes of the latest chunk of buckets */
+static size_t POOL_LEFT = 0; /**< Size of POOL */
+static __thread uint64_t SAMPLE_SEED __attribute__((tls_model("initial-exec"))); /**< State of the thread's sampling generator */
+
+/**
+ * Start, stop or retune allocation sampling
+ *
+ * Threads move to the new rate after the allocation that ends their current
+ * sampling interval, or within IDLE_INTERVAL bytes when sampling was off.
+ *
+ * @param rate Mean bytes allocated between samples, or 0 to stop sampling
+ */
+void tumalloc_set_profile_rate(size_t rate) {
+    // glibc loads its unwinder the first time backtrace runs, which allocates; do that now rather than mid-sample
+    void *frame;
+    backtrace(&frame, 1);
+    if (rate != 0) {
+        __atomic_store_n(&DUMP_RATE, rate, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&PROFILE_RATE, rate, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the sampling rate
+ *
+ * @return Mean bytes allocated between samples, zero when sampling is off
+ */
+size_t tu_profile_rate(void) {
+    return __atomic_load_n(&PROFILE_RATE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Draw the number of bytes the calling thread allocates before its next sample
+ *
+ * @return The interval, at least 1
+ */
+int64_t tu_profile_interval(void) {
+    size_t rate = tu_profile_rate();
+    if (rate == 0) {
+        return IDLE_INTERVAL;
+    }
+
+    // xorshift64*, seeded from the thread's own storage so threads do not sample in step
+    uint64_t x = SAMPLE_SEED;
+    if (x == 0) {
+        x = ((uintptr_t) &SAMPLE_SEED * 0x9e3779b97f4a7c15ULL) | 1;
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    SAMPLE_SEED = x;
+
+    // A uniform draw in (0, 1] turned into an exponential one
+    double uniform = (double) (((x * 0x2545f4914f6cdd1dULL) >> 11) + 1) / 9007199254740992.0;
+    double interval = -log(uniform) * (double) rate;
+    if (interval < 1.0) {
+        return 1;
+    }
+    return interval > (double) INT64_MAX / 2 ? INT64_MAX / 2 : (int64_t) interval;
+}
+
+/**
+ * Capture the stack of the allocation being sampled
+ *
+ * @param stack Where to store up to TU_PROFILE_DEPTH return addresses
+ * @return The number of addresses stored
+ */
+int tu_profile_backtrace(void **stack) {
+    void *frames[TU_PROFILE_DEPTH + 2];
+    int depth = backtrace(frames, TU_PROFILE_DEPTH + 2);
+
+    // Leave out this function and the allocator's sampling path
+    depth = depth > 2 ? depth - 2 : 0;
+    memcpy(stack, frames + 2, (size_t) depth * sizeof(void *));
+    return depth;
+}
+
+/**
+ * Find the bucket for a stack, making it if needed
+ *
+ * Call with the allocator lock held.
+ *
+ * @param stack Return addresses, innermost first
+ * @param depth The number of addresses
+ * @return The bucket, or NULL if no memory could be mapped for it
+ */
+tu_profile_bucket *tu_profile_bucket_for(void *const *stack, int depth) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t) stack[i]) * 0x100000001b3ULL;
+    }
+
+    tu_profile_bucket **chain = &TABLE[(hash ^ (hash >> 32)) & (BUCKET_TABLE_SIZE - 1)];
+    for (tu_profile_bucket *bucket = *chain; bucket != NULL; bucket = bucket->next) {
+        if (bucket->hash == hash && bucket->depth == depth &&
+            memcmp(bucket->stack, stack, (size_t) depth * sizeof(void *)) == 0) {
+            return bucket;
+        }
+    }
+
+    // Buckets come from mappings of their own, so sampling never recurses into the heap
+    if (POOL_LEFT < sizeof(tu_profile_bucket)) {
+        char *chunk = mmap(NULL, BUCKET_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            return NULL;
+        }
+        POOL = chunk;
+        POOL_LEFT = BUCKET_CHUNK;
+    }
+    tu_profile_bucket *bucket = (tu_profile_bucket *) POOL;
+    POOL += sizeof(tu_profile_bucket);
+    POOL_LEFT -= sizeof(tu_profile_bucket);
+
+    bucket->hash = hash;
+    bucket->depth = depth;
+    memcpy(bucket->stack, stack, (size_t) depth * sizeof(void *));
+    bucket->next = *chain;
+    *chain = bucket;
+    // Dumps walk the list without the lock, so the bucket is published only once it is filled in
+    bucket->all = BUCKETS;
+    __atomic_store_n(&BUCKETS, bucket, __ATOMIC_RELEASE);
+    return bucket;
+}
+
+/**
+ * Count a sampled allocation
+ *
+ * @param bucket The bucket of its stack
+ * @param size The size asked for
+ */
+void tu_profile_alloc(tu_profile_bucket *bucket, size_t size) {
+    __atomic_fetch_add(&bucket->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bucket->alloc_bytes, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count the free of a sampled allocation
+ *
+ * @param bucket The bucket of the stack it was allocated at
+ * @param size The size asked for when it was allocated
+ */
+void tu_profile_free(tu_profile_bucket *bucket, size_t size) {
+    __atomic_fetch_add(&bucket->frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&bucket->free_bytes, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * Write the heap profile in pprof's legacy heap format
+ *
+ * Each line gives the sampled objects and bytes still in use at one stack, then
+ * in brackets all those ever allocated there, so "pprof -inuse_space" shows the
+ * live heap and "pprof -alloc_space" the cumulative profile. The process's memory
+ * map follows, for pprof to symbolize the addresses with.
+ *
+ * @param fd The file descriptor to write to
+ * @return 0 on success, -1 on a write error
+ */
+int tumalloc_dump_profile(int fd) {
+    tu_profile_bucket *first = __atomic_load_n(&BUCKETS, __ATOMIC_ACQUIRE);
+    unsigned long long totals[4] = {0};
+    for (tu_profile_bucket *bucket = first; bucket != NULL; bucket = bucket->all) {
+        // Frees are read first, so a block freed meanwhile cannot make its count negative
+        uint64_t frees = __atomic_load_n(&bucket->frees, __ATOMIC_RELAXED);
+        uint64_t free_bytes = __atomic_load_n(&bucket->free_bytes, __ATOMIC_RELAXED);
+        uint64_t allocs = __atomic_load_n(&bucket->allocs, __ATOMIC_RELAXED);
+        uint64_t alloc_bytes = __atomic_load_n(&bucket->alloc_bytes, __ATOMIC_RELAXED);
+        totals[0] += allocs - frees;
+        totals[1] += alloc_bytes - free_bytes;
+        totals[2] += allocs;
+        totals[3] += alloc_bytes;
+    }
+
+    tu_out out;
+    tu_out_init(&out, fd, 0);
+    tu_out_printf(&out, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+                  totals[0], totals[1], totals[2], totals[3], __atomic_load_n(&DUMP_RATE, __ATOMIC_RELAXED));
+    for (tu_profile_bucket *bucket = first; bucket != NULL; bucket = bucket->all) {
+        uint64_t frees = __atomic_load_n(&bucket->frees, __ATOMIC_RELAXED);
+        uint64_t free_bytes = __atomic_load_n(&bucket->free_bytes, __ATOMIC_RELAXED);
+        uint64_t allocs = __atomic_load_n(&bucket->allocs, __ATOMIC_RELAXED);
+        uint64_t alloc_bytes = __atomic_load_n(&bucket->alloc_bytes, __ATOMIC_RELAXED);
+        tu_out_printf(&out, "%llu: %llu [%llu: %llu] @", (unsigned long long) (allocs - frees),
+                      (unsigned long long) (alloc_bytes - free_bytes), (unsigned long long) allocs,
+                      (unsigned long long) alloc_bytes);
+        for (int i = 0; i < bucket->depth; i++) {
+            tu_out_printf(&out, " 0x%llx", (unsigned long long) (uintptr_t) bucket->stack[i]);
+        }
+        tu_out_printf(&out, "\n");
+    }
+
+    tu_out_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps >= 0) {
+        char chunk[4096];
+        ssize_t length;
+        while ((length = read(maps, chunk, sizeof(chunk))) > 0) {
+            tu_out_write(&out, chunk, (size_t) length);
+        }
+        close(maps);
+    }
+    return tu_out_flush(&out);
+}
+
+/**
+ * Start sampling at load, if TUMALLOC_PROFILE_RATE gives a rate
+ */
+__attribute__((constructor)) static void profile_at_load(void) {
+    const char *rate = getenv("TUMALLOC_PROFILE_RATE");
+    if (rate != NULL && *rate != '\0') {
+        tumalloc_set_profile_rate((size_t) strtoull(rate, NULL, 0));
+    }
+}
+
+/**
+ * Dump the heap profile at exit, if TUMALLOC_PROFILE_FILE names a file for it
+ *
+ * A %p in the name stands for the process ID, as with TUMALLOC_HISTOGRAM_FILE.
+ */
+__attribute__((destructor)) static void dump_profile_at_exit(void) {
+    const char *name = getenv("TUMALLOC_PROFILE_FILE");
+    if (name == NULL || *name == '\0' || __atomic_load_n(&BUCKETS, __ATOMIC_ACQUIRE) == NULL) {
+        return;
+    }
+    char path[4096];
+    tu_expand_path(path, sizeof(path), name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        tumalloc_dump_profile(fd);
+        close(fd);
+    }
+}
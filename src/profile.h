@@ -0,0 +1,18 @@
+#ifndef CYB3053_PROJECT2_PROFILE_H
+#define CYB3053_PROJECT2_PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TU_PROFILE_DEPTH 32 /**< Most stack frames kept for each sampled allocation */
+
+typedef struct tu_profile_bucket tu_profile_bucket; /**< Counts of the samples taken at one stack */
+
+size_t tu_profile_rate(void);
+int64_t tu_profile_interval(void);
+int tu_profile_backtrace(void **stack);
+tu_profile_bucket *tu_profile_bucket_for(void *const *stack, int depth);
+void tu_profile_alloc(tu_profile_bucket *bucket, size_t size);
+void tu_profile_free(tu_profile_bucket *bucket, size_t size);
+
+#endif //CYB3053_PROJECT2_PROFILE_H
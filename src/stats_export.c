@@ -0,0 +1,257 @@
+#include "alloc.h"
+#include "output.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Exports tumalloc_stats for monitoring, as Prometheus text or as JSON. A dump
+ * can be written to any file descriptor on demand, or a helper thread can serve
+ * one to every client that connects to a Unix socket. Setting
+ * TUMALLOC_STATS_SOCKET starts the helper at load, with TUMALLOC_STATS_FORMAT
+ * picking "json" or "prometheus", the default.
+ */
+
+static pthread_mutex_t SERVER_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Guards starting the server */
+static int SERVER_FD = -1; /**< Listening socket of the server, -1 when none runs */
+static int SERVER_FORMAT = TU_STATS_PROMETHEUS; /**< Format the server writes */
+
+/**
+ * Write one Prometheus metric with no labels
+ *
+ * @param out The output
+ * @param name The name of the metric
+ * @param type "gauge" or "counter"
+ * @param help What the metric measures
+ * @param value The value
+ */
+static void prometheus_metric(tu_out *out, const char *name, const char *type, const char *help, double value) {
+    tu_out_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/**
+ * Write statistics in the Prometheus text format
+ *
+ * @param out The output
+ * @param stats The statistics
+ * @param resident The resident set size of the process
+ */
+static void write_prometheus(tu_out *out, const tu_stats *stats, size_t resident) {
+    prometheus_metric(out, "tumalloc_resident_bytes", "gauge", "Resident set size of the process.", (double) resident);
+    prometheus_metric(out, "tumalloc_mapped_bytes", "gauge", "Bytes taken from the system for blocks.", (double) stats->mapped);
+    prometheus_metric(out, "tumalloc_live_bytes", "gauge", "Bytes in blocks handed out and not yet freed.", (double) stats->live);
+    prometheus_metric(out, "tumalloc_free_bytes", "gauge", "Bytes of heap free for reuse.", (double) stats->free);
+    prometheus_metric(out, "tumalloc_cached_bytes", "gauge", "Bytes of blocks in thread caches.", (double) stats->cached);
+    prometheus_metric(out, "tumalloc_metadata_bytes", "gauge", "Bytes mapped for allocator metadata.", (double) stats->metadata);
+    prometheus_metric(out, "tumalloc_fragmentation_ratio", "gauge", "Share of mapped memory that is free or cached.", stats->fragmentation);
+    prometheus_metric(out, "tumalloc_large_allocs_total", "counter", "Large blocks allocated.", (double) stats->large_allocs);
+    prometheus_metric(out, "tumalloc_large_frees_total", "counter", "Large blocks freed.", (double) stats->large_frees);
+
+    // Each per-class family is written whole, since Prometheus wants a family's samples together
+    static const struct {
+        const char *name;
+        const char *type;
+        const char *help;
+    } families[] = {
+        { "tumalloc_class_allocs_total", "counter", "Blocks of the size class allocated." },
+        { "tumalloc_class_frees_total", "counter", "Blocks of the size class freed." },
+        { "tumalloc_class_cached_blocks", "gauge", "Blocks of the size class in thread caches." },
+        { "tumalloc_class_fragmentation_ratio", "gauge", "Share of bytes allocated in the size class lost to rounding." },
+    };
+    for (size_t family = 0; family < sizeof(families) / sizeof(families[0]); family++) {
+        tu_out_printf(out, "# HELP %s %s\n# TYPE %s %s\n", families[family].name, families[family].help,
+                   families[family].name, families[family].type);
+        for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+            const tu_class_stats *class_stats = &stats->classes[cls];
+            double value = family == 0 ? (double) class_stats->allocs
+                         : family == 1 ? (double) class_stats->frees
+                         : family == 2 ? (double) class_stats->cached
+                         : class_stats->fragmentation;
+            tu_out_printf(out, "%s{size=\"%zu\"} %.17g\n", families[family].name, class_stats->size, value);
+        }
+    }
+}
+
+/**
+ * Write statistics as a JSON object
+ *
+ * @param out The output
+ * @param stats The statistics
+ * @param resident The resident set size of the process
+ */
+static void write_json(tu_out *out, const tu_stats *stats, size_t resident) {
+    tu_out_printf(out, "{\"resident_bytes\":%zu,\"mapped_bytes\":%zu,\"live_bytes\":%zu,\"free_bytes\":%zu,",
+               resident, stats->mapped, stats->live, stats->free);
+    tu_out_printf(out, "\"cached_bytes\":%zu,\"metadata_bytes\":%zu,\"fragmentation\":%.6f,",
+               stats->cached, stats->metadata, stats->fragmentation);
+    tu_out_printf(out, "\"large_allocs\":%llu,\"large_frees\":%llu,\"classes\":[",
+               (unsigned long long) stats->large_allocs, (unsigned long long) stats->large_frees);
+    for (unsigned cls = 1; cls <= TU_NUM_CLASSES; cls++) {
+        const tu_class_stats *class_stats = &stats->classes[cls];
+        tu_out_printf(out, "%s{\"size\":%zu,\"allocs\":%llu,\"frees\":%llu,\"cached\":%llu,\"fragmentation\":%.6f}",
+                   cls == 1 ? "" : ",", class_stats->size, (unsigned long long) class_stats->allocs,
+                   (unsigned long long) class_stats->frees, (unsigned long long) class_stats->cached,
+                   class_stats->fragmentation);
+    }
+    tu_out_printf(out, "]}\n");
+}
+
+/**
+ * Write a snapshot of the statistics to a file descriptor or socket
+ *
+ * @param fd The file descriptor
+ * @param socket Whether fd is a socket
+ * @param format TU_STATS_PROMETHEUS or TU_STATS_JSON
+ * @return 0 on success, -1 on a write error or an unknown format
+ */
+static int dump_stats(int fd, int socket, int format) {
+    if (format != TU_STATS_PROMETHEUS && format != TU_STATS_JSON) {
+        return -1;
+    }
+    tu_stats stats;
+    tumalloc_stats(&stats);
+    size_t resident = tu_resident_bytes();
+
+    tu_out out;
+    tu_out_init(&out, fd, socket);
+    if (format == TU_STATS_JSON) {
+        write_json(&out, &stats, resident);
+    } else {
+        write_prometheus(&out, &stats, resident);
+    }
+    return tu_out_flush(&out);
+}
+
+/**
+ * Write a snapshot of the allocator's statistics
+ *
+ * @param fd The file descriptor to write to
+ * @param format TU_STATS_PROMETHEUS or TU_STATS_JSON
+ * @return 0 on success, -1 on a write error or an unknown format
+ */
+int tumalloc_dump_stats(int fd, int format) {
+    return dump_stats(fd, 0, format);
+}
+
+/**
+ * Serve a snapshot to each client of the stats socket, for as long as the process runs
+ *
+ * @param arg Unused
+ * @return Never returns unless accept fails for good
+ */
+static void *serve_stats(void *arg) {
+    (void) arg;
+    for (;;) {
+        int client = accept(SERVER_FD, NULL, NULL);
+        if (client < 0) {
+            // Clients giving up before they are accepted are no reason to stop
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
+            }
+            return NULL;
+        }
+        dump_stats(client, 1, SERVER_FORMAT);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a socket was left behind by a server that is gone
+ *
+ * @param address The address of the socket
+ * @return Non-zero if connecting is refused, so nothing listens on it any more
+ */
+static int socket_is_stale(const struct sockaddr_un *address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return 0;
+    }
+    int stale = connect(probe, (const struct sockaddr *) address, sizeof(*address)) != 0 && errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+/**
+ * Start a helper thread serving statistics on a Unix socket
+ *
+ * Every client that connects is sent one snapshot and disconnected. A stale
+ * socket left at the path is replaced; a socket another server still listens on,
+ * or any other file there, is left alone and the call fails.
+ *
+ * @param path The path to listen on
+ * @param format TU_STATS_PROMETHEUS or TU_STATS_JSON
+ * @return 0 on success, -1 if the socket or thread could not be set up or a server already runs
+ */
+int tumalloc_serve_stats(const char *path, int format) {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if ((format != TU_STATS_PROMETHEUS && format != TU_STATS_JSON) || strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    pthread_mutex_lock(&SERVER_LOCK);
+    if (SERVER_FD >= 0) {
+        pthread_mutex_unlock(&SERVER_LOCK);
+        return -1;
+    }
+
+    struct stat existing;
+    if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        // Another process started with the same path keeps its endpoint
+        if (!socket_is_stale(&address)) {
+            pthread_mutex_unlock(&SERVER_LOCK);
+            return -1;
+        }
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        pthread_mutex_unlock(&SERVER_LOCK);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, 8) != 0) {
+        close(fd);
+        pthread_mutex_unlock(&SERVER_LOCK);
+        return -1;
+    }
+
+    SERVER_FD = fd;
+    SERVER_FORMAT = format;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_stats, NULL) != 0) {
+        SERVER_FD = -1;
+        close(fd);
+        unlink(path);
+        pthread_mutex_unlock(&SERVER_LOCK);
+        return -1;
+    }
+    pthread_detach(thread);
+    pthread_mutex_unlock(&SERVER_LOCK);
+    return 0;
+}
+
+/**
+ * Start the stats server at load, if TUMALLOC_STATS_SOCKET names a socket for it
+ *
+ * A %p in the name is replaced by the process ID, so that every process of a
+ * preloaded pipeline gets its own socket.
+ */
+__attribute__((constructor)) static void serve_stats_at_load(void) {
+    const char *name = getenv("TUMALLOC_STATS_SOCKET");
+    if (name == NULL || *name == '\0') {
+        return;
+    }
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    tu_expand_path(path, sizeof(path), name);
+    const char *format = getenv("TUMALLOC_STATS_FORMAT");
+    tumalloc_serve_stats(path, format != NULL && strcmp(format, "json") == 0 ? TU_STATS_JSON : TU_STATS_PROMETHEUS);
+}
@@ -0,0 +1,433 @@
+#define TU_TRACE_INTERNAL /* The recorder calls the allocator itself, not the recording macros */
+
+#include "alloc.h"
+#include "output.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RING_BYTES (256 * 1024) /**< Bytes of events each thread's ring holds, a power of two */
+#define FLUSH_INTERVAL_NS (10 * 1000 * 1000) /**< How often the flusher drains the rings */
+
+/*
+ * With TU_TRACE, alloc.h routes every tumalloc, tucalloc, turealloc, tumemalign,
+ * tufree and tufree_sized call here, and once tumalloc_trace_start has opened a
+ * trace each one is encoded into a ring buffer of the calling thread. A flusher
+ * thread drains the rings into the trace every FLUSH_INTERVAL_NS, or sooner when
+ * one fills up; a thread finding its ring full waits for it rather than losing
+ * events. See trace.h for the format.
+ *
+ * Rings are mapped with mmap and events encoded on the stack, so recording never
+ * allocates. Anything the allocator is asked for while an event is being
+ * recorded, such as by pthread_setspecific, is left out of the trace.
+ */
+
+/**
+ * Ring of encoded events written by one thread and drained by the flusher
+ */
+typedef struct trace_ring {
+    uint64_t head; /**< Bytes ever written; only the owning thread moves it */
+    uint64_t tail; /**< Bytes ever drained; only the flusher moves it */
+    uint64_t last_time; /**< Time of the thread's previous event */
+    uint64_t last_id; /**< Id in the thread's previous event */
+    uint64_t thread; /**< Number the thread's chunks are tagged with */
+    int state; /**< 0 while its thread runs, 1 once the thread exits, 2 when drained and free for another thread */
+    struct trace_ring *next; /**< Next ring of the trace; rings are never unlinked */
+    uint8_t data[]; /**< The events, at offsets modulo RING_DATA */
+} trace_ring;
+
+#define RING_DATA (RING_BYTES - sizeof(trace_ring)) /**< Bytes of data in a ring */
+
+static int TRACING = 0; /**< Whether events are being recorded */
+static int TRACE_FD = -1; /**< The trace file, -1 before the trace starts */
+static uint64_t TRACE_START = 0; /**< Time the trace started, in nanoseconds */
+static uint64_t THREADS = 0; /**< Number of thread numbers handed out */
+static trace_ring *RINGS = NULL; /**< Every ring, newest first */
+static pthread_mutex_t RINGS_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Guards handing rings to threads */
+static pthread_mutex_t FLUSH_LOCK = PTHREAD_MUTEX_INITIALIZER; /**< Guards draining the rings and FLUSH_STOP */
+static pthread_cond_t FLUSH_WAKE = PTHREAD_COND_INITIALIZER; /**< Signalled when a ring fills or the trace stops */
+static int FLUSH_STOP = 0; /**< Tells the flusher to exit */
+static pthread_t FLUSHER; /**< The flusher thread */
+static pthread_key_t RING_KEY; /**< Key whose destructor gives up a thread's ring when it exits */
+static __thread trace_ring *RING __attribute__((tls_model("initial-exec"))); /**< The calling thread's ring */
+static __thread int RECORDING __attribute__((tls_model("initial-exec"))); /**< Set while the thread records an event */
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Mark a thread's ring for the flusher to drain and hand on, as the thread exits
+ *
+ * @param arg The thread's ring
+ */
+static void ring_exit(void *arg) {
+    trace_ring *ring = arg;
+    RING = NULL;
+    __atomic_store_n(&ring->state, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the calling thread's ring, taking a free one or mapping a new one the first time
+ *
+ * @return The ring, or NULL if none could be mapped
+ */
+static trace_ring *ring_get(void) {
+    if (RING != NULL) {
+        return RING;
+    }
+
+    pthread_mutex_lock(&RINGS_LOCK);
+    trace_ring *ring;
+    for (ring = RINGS; ring != NULL; ring = ring->next) {
+        if (__atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == 2) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = mmap(NULL, RING_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            pthread_mutex_unlock(&RINGS_LOCK);
+            return NULL;
+        }
+        ring->next = RINGS;
+        __atomic_store_n(&RINGS, ring, __ATOMIC_RELEASE);
+    }
+    // A drained ring starts over as a new thread, so its events need no state from the last one
+    ring->last_time = TRACE_START;
+    ring->last_id = 0;
+    ring->thread = ++THREADS;
+    __atomic_store_n(&ring->state, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&RINGS_LOCK);
+
+    RING = ring;
+    pthread_setspecific(RING_KEY, ring);
+    return ring;
+}
+
+/**
+ * Copy an encoded event into a ring, waiting for the flusher if the ring is full
+ *
+ * @param ring The calling thread's ring
+ * @param event The encoded event
+ * @param length Its length
+ */
+static void ring_put(trace_ring *ring, const uint8_t *event, size_t length) {
+    uint64_t head = ring->head;
+    while (RING_DATA - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) < length) {
+        if (!__atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+            return;
+        }
+        pthread_cond_signal(&FLUSH_WAKE);
+        sched_yield();
+    }
+
+    size_t offset = head % RING_DATA;
+    size_t first = RING_DATA - offset < length ? RING_DATA - offset : length;
+    memcpy(ring->data + offset, event, first);
+    memcpy(ring->data, event + first, length - first);
+    // The flusher reads the bytes only once it sees the new head
+    __atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+/**
+ * Encode a block's id as the difference from the thread's previous id
+ *
+ * @param out Where to write
+ * @param ring The calling thread's ring
+ * @param ptr The block, or NULL
+ * @return A pointer just past the encoded id
+ */
+static uint8_t *put_id(uint8_t *out, trace_ring *ring, const void *ptr) {
+    uint64_t id = (uintptr_t) ptr >> 4;
+    out = tu_trace_put(out, tu_trace_zigzag((int64_t) (id - ring->last_id)));
+    ring->last_id = id;
+    return out;
+}
+
+/**
+ * Record one event in the calling thread's ring
+ *
+ * @param op What happened, one of tu_trace_op
+ * @param time When it happened
+ * @param size The size asked for, or the alignment for TU_TRACE_MEMALIGN
+ * @param extra The size asked for with TU_TRACE_MEMALIGN
+ * @param old The block given to TU_TRACE_REALLOC
+ * @param ptr The block allocated, or freed for TU_TRACE_FREE
+ */
+static void record(int op, uint64_t time, size_t size, size_t extra, const void *old, const void *ptr) {
+    if (RECORDING) {
+        return;
+    }
+    RECORDING = 1;
+    trace_ring *ring = ring_get();
+    if (ring != NULL) {
+        uint8_t event[TU_TRACE_EVENT_MAX];
+        uint8_t *out = event;
+        *out++ = (uint8_t) op;
+        // Another thread's clock read may land just before this thread's previous one
+        out = tu_trace_put(out, time > ring->last_time ? time - ring->last_time : 0);
+        ring->last_time = time > ring->last_time ? time : ring->last_time;
+        if (op != TU_TRACE_FREE) {
+            out = tu_trace_put(out, size);
+        }
+        if (op == TU_TRACE_MEMALIGN) {
+            out = tu_trace_put(out, extra);
+        }
+        if (op == TU_TRACE_REALLOC) {
+            out = put_id(out, ring, old);
+        }
+        out = put_id(out, ring, ptr);
+        ring_put(ring, event, (size_t) (out - event));
+    }
+    RECORDING = 0;
+}
+
+/**
+ * Write out everything the rings hold, as one chunk per ring
+ *
+ * Call with FLUSH_LOCK held.
+ */
+static void drain_rings(void) {
+    tu_out out;
+    tu_out_init(&out, TRACE_FD, 0);
+    for (trace_ring *ring = __atomic_load_n(&RINGS, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        // The state is read first, so a ring marked exited is drained of everything its thread wrote
+        int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        if (head != tail) {
+            uint8_t header[20];
+            uint8_t *end = tu_trace_put(tu_trace_put(header, ring->thread), head - tail);
+            tu_out_write(&out, (const char *) header, (size_t) (end - header));
+            size_t offset = tail % RING_DATA;
+            size_t first = RING_DATA - offset < head - tail ? RING_DATA - offset : head - tail;
+            tu_out_write(&out, (const char *) ring->data + offset, first);
+            tu_out_write(&out, (const char *) ring->data, head - tail - first);
+            // The thread may reuse the space once the chunk is on its way out
+            tu_out_flush(&out);
+            __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+        }
+        if (state == 1) {
+            __atomic_store_n(&ring->state, 2, __ATOMIC_RELEASE);
+        }
+    }
+    tu_out_flush(&out);
+}
+
+/**
+ * Drain the rings every FLUSH_INTERVAL_NS until the trace stops
+ *
+ * @param arg Unused
+ * @return NULL
+ */
+static void *flush_rings(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&FLUSH_LOCK);
+    while (!FLUSH_STOP) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_nsec += FLUSH_INTERVAL_NS;
+        if (wake.tv_nsec >= 1000000000) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&FLUSH_WAKE, &FLUSH_LOCK, &wake);
+        drain_rings();
+    }
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    return NULL;
+}
+
+/**
+ * Stop tracing in a forked child, which has no flusher to drain its rings
+ */
+static void trace_fork_child(void) {
+    TRACING = 0;
+    if (TRACE_FD >= 0) {
+        close(TRACE_FD);
+        TRACE_FD = -1;
+    }
+}
+
+/**
+ * Start recording every allocation and free into a trace file
+ *
+ * A process is traced at most once; a trace runs until tumalloc_trace_stop or exit.
+ *
+ * @param path The trace file to create
+ * @return 0 on success, -1 if the file or the flusher could not be set up, or a trace was already started
+ */
+int tumalloc_trace_start(const char *path) {
+    if (TRACE_FD >= 0 || TRACE_START != 0) {
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    TRACE_START = now_ns();
+    uint8_t header[TU_TRACE_MAGIC_SIZE + 10];
+    memcpy(header, TU_TRACE_MAGIC, TU_TRACE_MAGIC_SIZE);
+    uint8_t *end = tu_trace_put(header + TU_TRACE_MAGIC_SIZE, TRACE_START);
+    if (write(fd, header, (size_t) (end - header)) != end - header ||
+        pthread_key_create(&RING_KEY, ring_exit) != 0) {
+        close(fd);
+        return -1;
+    }
+    TRACE_FD = fd;
+    if (pthread_create(&FLUSHER, NULL, flush_rings, NULL) != 0) {
+        close(fd);
+        TRACE_FD = -1;
+        return -1;
+    }
+    pthread_atfork(NULL, NULL, trace_fork_child);
+    __atomic_store_n(&TRACING, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Stop recording, write out the last events and close the trace
+ */
+void tumalloc_trace_stop(void) {
+    if (!__atomic_load_n(&TRACING, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    __atomic_store_n(&TRACING, 0, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&FLUSH_LOCK);
+    FLUSH_STOP = 1;
+    pthread_cond_signal(&FLUSH_WAKE);
+    pthread_mutex_unlock(&FLUSH_LOCK);
+    pthread_join(FLUSHER, NULL);
+
+    drain_rings();
+    close(TRACE_FD);
+    TRACE_FD = -1;
+}
+
+/**
+ * Allocate memory, recording the allocation
+ *
+ * The untraced macros are in force here, so the call takes the same inline fast
+ * path, histogram included, as in a build without TU_TRACE.
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+void *tu_traced_malloc(size_t size) {
+    void *ptr = tumalloc(size);
+    if (__atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        record(TU_TRACE_MALLOC, now_ns(), size, 0, NULL, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * Allocate zeroed memory, recording the allocation
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the block
+ */
+void *tu_traced_calloc(size_t num, size_t size) {
+    void *ptr = tucalloc(num, size);
+    if (__atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        size_t total;
+        record(TU_TRACE_CALLOC, now_ns(), __builtin_mul_overflow(num, size, &total) ? SIZE_MAX : total, 0, NULL, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * Resize a block, recording the reallocation
+ *
+ * @param ptr The block, or NULL
+ * @param new_size The new size
+ * @return A pointer to the resized block
+ */
+void *tu_traced_realloc(void *ptr, size_t new_size) {
+    uint64_t time = now_ns();
+    void *new_ptr = turealloc(ptr, new_size);
+    if (__atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        record(TU_TRACE_REALLOC, time, new_size, 0, ptr, new_ptr);
+    }
+    return new_ptr;
+}
+
+/**
+ * Allocate aligned memory, recording the allocation
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+void *tu_traced_memalign(size_t alignment, size_t size) {
+    void *ptr = tumemalign(alignment, size);
+    if (__atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        record(TU_TRACE_MEMALIGN, now_ns(), alignment, size, NULL, ptr);
+    }
+    return ptr;
+}
+
+/**
+ * Free memory, recording the free
+ *
+ * @param ptr The block, or NULL
+ */
+void tu_traced_free(void *ptr) {
+    if (ptr != NULL && __atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        record(TU_TRACE_FREE, now_ns(), 0, 0, NULL, ptr);
+    }
+    tufree(ptr);
+}
+
+/**
+ * Free memory of a known size, recording the free
+ *
+ * @param ptr The block, or NULL
+ * @param size The size that was asked for when it was allocated
+ */
+void tu_traced_free_sized(void *ptr, size_t size) {
+    if (ptr != NULL && __atomic_load_n(&TRACING, __ATOMIC_RELAXED)) {
+        record(TU_TRACE_FREE, now_ns(), 0, 0, NULL, ptr);
+    }
+    tufree_sized(ptr, size);
+}
+
+/**
+ * Start tracing at load, if TUMALLOC_TRACE_FILE names a file for the trace
+ *
+ * A %p in the name is replaced by the process ID, so each process writes its own trace.
+ */
+__attribute__((constructor)) static void trace_at_load(void) {
+    const char *name = getenv("TUMALLOC_TRACE_FILE");
+    if (name == NULL || *name == '\0') {
+        return;
+    }
+    char path[4096];
+    tu_expand_path(path, sizeof(path), name);
+    tumalloc_trace_start(path);
+}
+
+/**
+ * Write out the rest of the trace at exit
+ */
+__attribute__((destructor)) static void trace_at_exit(void) {
+    tumalloc_trace_stop();
+}
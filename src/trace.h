@@ -0,0 +1,99 @@
+#ifndef CYB3053_PROJECT2_TRACE_H
+#define CYB3053_PROJECT2_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Allocation trace format, written by a TUMALLOC_TRACE build and read by tureplay.
+ *
+ * A trace starts with TU_TRACE_MAGIC and the start time in nanoseconds, then is a
+ * series of chunks: the thread number, the chunk's length in bytes, and that many
+ * bytes of the thread's events. Numbers are LEB128 varints. Each event is its op
+ * byte and the nanoseconds since the thread's previous event (since the start, for
+ * its first), followed by
+ *
+ *     TU_TRACE_MALLOC, TU_TRACE_CALLOC   size, id
+ *     TU_TRACE_REALLOC                   size, old id, id
+ *     TU_TRACE_MEMALIGN                  alignment, size, id
+ *     TU_TRACE_FREE                      id
+ *
+ * A block's id is its address divided by 16, or 0 for NULL, stored zigzagged as
+ * the difference from the thread's previous id. Allocations are stamped when they
+ * return and frees and reallocs when they are called, so sorting every thread's
+ * events by time orders a free before any reuse of its address.
+ */
+
+#define TU_TRACE_MAGIC "TUTRACE1" /**< First bytes of a trace */
+#define TU_TRACE_MAGIC_SIZE 8 /**< Length of TU_TRACE_MAGIC */
+#define TU_TRACE_EVENT_MAX (1 + 5 * 10) /**< Most bytes one event encodes to */
+
+/**
+ * Kinds of traced event
+ */
+enum tu_trace_op {
+    TU_TRACE_MALLOC = 0, /**< tumalloc */
+    TU_TRACE_CALLOC = 1, /**< tucalloc, with the total size */
+    TU_TRACE_REALLOC = 2, /**< turealloc */
+    TU_TRACE_FREE = 3, /**< tufree or tufree_sized */
+    TU_TRACE_MEMALIGN = 4, /**< tumemalign */
+};
+
+/**
+ * Append a varint
+ *
+ * @param out Where to write, with room for 10 bytes
+ * @param value The number
+ * @return A pointer just past the varint
+ */
+static inline uint8_t *tu_trace_put(uint8_t *out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+/**
+ * Read a varint
+ *
+ * @param in The position to read from, advanced past the varint
+ * @param end The end of the data
+ * @param value Set to the number
+ * @return 0 on success, -1 if the varint runs past the end or is too long
+ */
+static inline int tu_trace_get(const uint8_t **in, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64 && *in < end; shift += 7) {
+        uint8_t byte = *(*in)++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Map a signed difference onto an unsigned number that is small when the difference is
+ *
+ * @param value The difference
+ * @return The zigzag encoding
+ */
+static inline uint64_t tu_trace_zigzag(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+/**
+ * Undo tu_trace_zigzag
+ *
+ * @param value The zigzag encoding
+ * @return The difference
+ */
+static inline int64_t tu_trace_unzigzag(uint64_t value) {
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+#endif //CYB3053_PROJECT2_TRACE_H
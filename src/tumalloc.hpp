@@ -0,0 +1,342 @@
+#ifndef CYB3053_PROJECT2_TUMALLOC_HPP
+#define CYB3053_PROJECT2_TUMALLOC_HPP
+
+#include "alloc.h"
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+
+/*
+ * C++ adapters for tumalloc: tu::heap owns a private heap, tu::fixed<N> allocates
+ * a constant size through its size class, tu::allocator<T> plugs the global heap
+ * or a private one into standard containers, and tu::resource does the same for
+ * std::pmr containers:
+ *
+ *     tu::heap nodes(TU_HEAP_ARENA);
+ *     std::map<int, int, std::less<int>, tu::allocator<std::pair<const int, int>>> m(nodes);
+ *
+ *     tu::resource pool(nodes);
+ *     std::pmr::vector<int> v(&pool);
+ *
+ * A private heap takes no lock, so containers sharing one must not be used from
+ * several threads at once. The global heap is safe to use from any thread.
+ */
+namespace tu {
+
+/**
+ * Owner of a private tumalloc heap, deleting the heap and everything in it when destroyed
+ */
+class heap {
+public:
+    /**
+     * Create a private heap
+     *
+     * @param flags TU_HEAP_ARENA for a heap whose blocks are only given back when it is destroyed
+     */
+    explicit heap(int flags = 0) : heap_(tu_heap_new(flags)) {
+        if (heap_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~heap() {
+        tu_heap_delete(heap_);
+    }
+
+    heap(const heap &) = delete;
+    heap &operator=(const heap &) = delete;
+
+    /**
+     * Get the underlying C heap
+     *
+     * @return The heap
+     */
+    tu_heap *get() const noexcept {
+        return heap_;
+    }
+
+private:
+    tu_heap *heap_; /**< The heap this object owns */
+};
+
+namespace detail {
+
+/**
+ * Allocate from a heap, or from the global heap if there is none
+ *
+ * @param heap The heap, or nullptr for the global heap
+ * @param size The amount of memory to allocate
+ * @param alignment The alignment, a power of two
+ * @return A pointer to the block
+ */
+inline void *allocate(tu_heap *heap, std::size_t size, std::size_t alignment) {
+    void *ptr;
+    if (heap != nullptr) {
+        ptr = tu_heap_alloc(heap, size, alignment);
+    } else if (alignment > alignof(std::max_align_t)) {
+        ptr = tumemalign(alignment, size);
+    } else {
+        ptr = tumalloc(size);
+    }
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+/**
+ * Free a block from a heap, or from the global heap if there is none
+ *
+ * @param heap The heap the block came from, or nullptr for the global heap
+ * @param ptr Pointer to the block
+ * @param size The size it was allocated with
+ * @param alignment The alignment it was allocated with
+ */
+inline void deallocate(tu_heap *heap, void *ptr, std::size_t size, std::size_t alignment) noexcept {
+    if (heap != nullptr) {
+        tu_heap_free(heap, ptr);
+    } else if (alignment > alignof(std::max_align_t)) {
+        tufree(ptr);
+    } else {
+        tufree_sized(ptr, size);
+    }
+}
+
+/**
+ * Find the size class of a request at compile time, the same way tu_size_class does
+ *
+ * @param size The size
+ * @return The size class, or 0 for sizes too big to have one
+ */
+constexpr unsigned size_class(std::size_t size) {
+    if (size > TU_SMALL_MAX) {
+        return 0;
+    }
+    if (size <= TU_LOOKUP_MAX) {
+        return tu_class_lookup[(size + 15) >> 4];
+    }
+    unsigned top = 63 - static_cast<unsigned>(__builtin_clzll(size - 1));
+    unsigned step = static_cast<unsigned>((size - 1) >> (top - TU_CLASS_STEP_BITS)) & ((1u << TU_CLASS_STEP_BITS) - 1);
+    return TU_FIRST_STEP_CLASS + ((top - TU_LOOKUP_SHIFT) << TU_CLASS_STEP_BITS) + step;
+}
+
+} // namespace detail
+
+/**
+ * Allocation of one constant size, with its size class worked out at compile time
+ *
+ * For sizes up to TU_SMALL_MAX, allocate compiles down to a pop off the thread
+ * cache and deallocate to a push back onto it:
+ *
+ *     node *n = static_cast<node *>(tu::fixed<sizeof(node)>::allocate());
+ *
+ * @tparam Size The size of every allocation
+ */
+template <std::size_t Size>
+struct fixed {
+    /** The size class, or 0 for sizes too big to have one */
+    static constexpr unsigned size_class = detail::size_class(Size);
+
+    /**
+     * Allocate a block of Size bytes
+     *
+     * @return A pointer to the block
+     */
+    static void *allocate() {
+        void *ptr;
+#ifdef TU_TRACE
+        // Traced builds log every allocation, so none may skip the recorder, which counts the size itself
+        ptr = tumalloc(Size);
+#else
+        tu_histogram_record(Size);
+        if constexpr (size_class != 0) {
+            ptr = tu_alloc_class(size_class, Size);
+        } else {
+            ptr = (tumalloc)(Size);
+        }
+#endif
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    /**
+     * Free a block from allocate
+     *
+     * @param ptr Pointer to the block, or nullptr
+     */
+    static void deallocate(void *ptr) noexcept {
+        tufree_sized(ptr, Size);
+    }
+};
+
+/**
+ * Standard allocator drawing from the global heap or from a private one
+ *
+ * The heap travels with the allocator through rebinding, copies and container
+ * assignment, so every node of a container comes from the same heap.
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    template <class U>
+    struct rebind {
+        using other = allocator<U>;
+    };
+
+    /**
+     * Create an allocator for the global heap
+     */
+    allocator() noexcept = default;
+
+    /**
+     * Create an allocator for a private heap
+     *
+     * @param heap The heap, or nullptr for the global heap
+     */
+    allocator(tu_heap *heap) noexcept : heap_(heap) {}
+
+    /**
+     * Create an allocator for a private heap
+     *
+     * @param heap The heap, which must outlive the allocator and everything it allocates
+     */
+    allocator(const tu::heap &heap) noexcept : heap_(heap.get()) {}
+
+    /**
+     * Rebind an allocator to another type, keeping its heap
+     *
+     * @param other The allocator to copy the heap from
+     */
+    template <class U>
+    allocator(const allocator<U> &other) noexcept : heap_(other.get_heap()) {}
+
+    /**
+     * Allocate room for objects
+     *
+     * @param n How many objects
+     * @return A pointer to uninitialized room for them
+     */
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        return static_cast<T *>(detail::allocate(heap_, n * sizeof(T), alignof(T)));
+    }
+
+    /**
+     * Free room for objects
+     *
+     * @param ptr Pointer returned by allocate
+     * @param n How many objects it was allocated for
+     */
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        detail::deallocate(heap_, ptr, n * sizeof(T), alignof(T));
+    }
+
+    /**
+     * Get the heap the allocator draws from
+     *
+     * @return The heap, or nullptr for the global heap
+     */
+    tu_heap *get_heap() const noexcept {
+        return heap_;
+    }
+
+private:
+    tu_heap *heap_ = nullptr; /**< The heap to draw from, nullptr for the global heap */
+};
+
+/**
+ * Check whether two allocators can free each other's memory
+ *
+ * @return Whether they draw from the same heap
+ */
+template <class T, class U>
+bool operator==(const allocator<T> &a, const allocator<U> &b) noexcept {
+    return a.get_heap() == b.get_heap();
+}
+
+/**
+ * Check whether two allocators cannot free each other's memory
+ *
+ * @return Whether they draw from different heaps
+ */
+template <class T, class U>
+bool operator!=(const allocator<T> &a, const allocator<U> &b) noexcept {
+    return !(a == b);
+}
+
+/**
+ * Polymorphic memory resource drawing from the global heap or from a private one
+ */
+class resource : public std::pmr::memory_resource {
+public:
+    /**
+     * Create a resource for the global heap
+     */
+    resource() noexcept = default;
+
+    /**
+     * Create a resource for a private heap
+     *
+     * @param heap The heap, or nullptr for the global heap
+     */
+    explicit resource(tu_heap *heap) noexcept : heap_(heap) {}
+
+    /**
+     * Create a resource for a private heap
+     *
+     * @param heap The heap, which must outlive the resource and everything it allocates
+     */
+    explicit resource(const tu::heap &heap) noexcept : heap_(heap.get()) {}
+
+    /**
+     * Get the heap the resource draws from
+     *
+     * @return The heap, or nullptr for the global heap
+     */
+    tu_heap *get_heap() const noexcept {
+        return heap_;
+    }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return detail::allocate(heap_, bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        detail::deallocate(heap_, ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const resource *that = dynamic_cast<const resource *>(&other);
+        return that != nullptr && that->heap_ == heap_;
+    }
+
+    tu_heap *heap_ = nullptr; /**< The heap to draw from, nullptr for the global heap */
+};
+
+/**
+ * Get a resource for the global heap
+ *
+ * @return A resource that lives for the whole program
+ */
+inline resource *global_resource() noexcept {
+    static resource global;
+    return &global;
+}
+
+} // namespace tu
+
+#endif //CYB3053_PROJECT2_TUMALLOC_HPP
@@ -0,0 +1,356 @@
+#include "alloc.h"
+#include "pagemap.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Behavior checks for the C interface, one group per CTest test:
+ *
+ *     tumalloc_alloc_test realloc|memalign|calloc|sized|threads
+ *
+ * Every group frees everything it allocates and then checks that tumalloc_stats
+ * counts no live bytes, so a block leaked on the way fails the test.
+ */
+
+#define THREADS 4 /**< Threads the threaded group runs */
+#define THREAD_SLOTS 512 /**< Blocks each thread keeps live at a time */
+#define THREAD_OPS 200000 /**< Allocations or frees each thread makes */
+
+/**
+ * Stop the test if a condition does not hold
+ *
+ * @param ok The condition
+ * @param what What was checked, printed on failure
+ */
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        exit(1);
+    }
+}
+
+/**
+ * Check that no block is left live
+ *
+ * @param what The group that just ran
+ */
+static void check_nothing_live(const char *what) {
+    tu_stats stats;
+    tumalloc_stats(&stats);
+    if (stats.live != 0) {
+        fprintf(stderr, "FAILED: %s leaves %zu bytes live\n", what, stats.live);
+        exit(1);
+    }
+}
+
+/**
+ * Fill a block with a pattern that depends on a seed and the offset
+ *
+ * @param ptr The block
+ * @param size Its size
+ * @param seed The seed
+ */
+static void fill(unsigned char *ptr, size_t size, unsigned seed) {
+    for (size_t i = 0; i < size; i++) {
+        ptr[i] = (unsigned char) (i * 31 + seed);
+    }
+}
+
+/**
+ * Check that a block still holds the pattern from fill
+ *
+ * @param ptr The block
+ * @param size How much of it to check
+ * @param seed The seed it was filled with
+ * @return Non-zero if every byte matches
+ */
+static int holds(const unsigned char *ptr, size_t size, unsigned seed) {
+    for (size_t i = 0; i < size; i++) {
+        if (ptr[i] != (unsigned char) (i * 31 + seed)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Check that a block is all zeros
+ *
+ * @param ptr The block
+ * @param size Its size
+ * @return Non-zero if every byte is zero
+ */
+static int zeroed(const unsigned char *ptr, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (ptr[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Check that realloc keeps the contents and frees the old block, across size classes, the heap and page runs
+ */
+static void test_realloc(void) {
+    static const size_t sizes[] = { 1, 24, 100, 1000, 5000, 40000, 100000, 300000, 2000000 };
+    size_t count = sizeof(sizes) / sizeof(sizes[0]);
+
+    for (size_t from = 0; from < count; from++) {
+        for (size_t to = 0; to < count; to++) {
+            unsigned char *ptr = tumalloc(sizes[from]);
+            check(ptr != NULL, "malloc before realloc");
+            fill(ptr, sizes[from], (unsigned) from);
+
+            unsigned char *moved = turealloc(ptr, sizes[to]);
+            check(moved != NULL, "realloc");
+            size_t kept = sizes[from] < sizes[to] ? sizes[from] : sizes[to];
+            check(holds(moved, kept, (unsigned) from), "realloc keeps the contents");
+            fill(moved, sizes[to], (unsigned) to);
+            tufree(moved);
+        }
+    }
+
+    // Growing one block step by step must not leave a trail of old blocks behind
+    unsigned char *grown = NULL;
+    for (size_t size = 16; size <= 4 << 20; size *= 2) {
+        grown = turealloc(grown, size);
+        check(grown != NULL && (grown[0] == 0x5a || size == 16), "realloc from NULL and growing");
+        grown[0] = 0x5a;
+    }
+    tufree(grown);
+    check_nothing_live("realloc");
+}
+
+/**
+ * Check that memalign honors every power-of-two alignment, in the heap and in page runs
+ */
+static void test_memalign(void) {
+    static const size_t sizes[] = { 1, 100, 5000, 200000 };
+
+    for (size_t alignment = 16; alignment <= 2 << 20; alignment *= 2) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            unsigned char *ptr = tumemalign(alignment, sizes[i]);
+            check(ptr != NULL, "memalign");
+            check((uintptr_t) ptr % alignment == 0, "memalign honors the alignment");
+            check(tumalloc_usable_size(ptr) >= sizes[i], "memalign gives at least the size");
+            fill(ptr, sizes[i], (unsigned) i);
+            check(holds(ptr, sizes[i], (unsigned) i), "memalign blocks hold their contents");
+            tufree(ptr);
+        }
+    }
+    check_nothing_live("memalign");
+}
+
+/**
+ * Allocate dirty blocks, free them, and check that calloc hands the memory back zeroed
+ *
+ * @param size The size of each block
+ * @param count How many blocks; enough to make the allocator decommit some
+ */
+static void calloc_after_free(size_t size, size_t count) {
+    unsigned char **blocks = tucalloc(count, sizeof(*blocks));
+    check(blocks != NULL, "calloc of the block table");
+
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = tumalloc(size);
+        check(blocks[i] != NULL, "malloc before calloc");
+        memset(blocks[i], 0xa5, size);
+    }
+
+    // Every other block first, so some free memory stays split up and some merges
+    for (size_t i = 0; i < count; i += 2) {
+        tufree(blocks[i]);
+    }
+    for (size_t i = 1; i < count; i += 2) {
+        tufree(blocks[i]);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        blocks[i] = tucalloc(1, size);
+        check(blocks[i] != NULL && zeroed(blocks[i], size), "calloc zeroes reused memory");
+        memset(blocks[i], 0xa5, size);
+    }
+    for (size_t i = 0; i < count; i++) {
+        tufree(blocks[i]);
+    }
+    tufree(blocks);
+}
+
+/**
+ * Check calloc zeroing for class blocks, heap blocks and page runs, before and after their pages are given back
+ */
+static void test_calloc(void) {
+    calloc_after_free(48, 1000);
+    calloc_after_free(3000, 200);
+    calloc_after_free(96 * 1024, 80);
+    calloc_after_free(256 * 1024, 80);
+    calloc_after_free(3 << 20, 12);
+
+    check(tucalloc(SIZE_MAX / 2, 3) == NULL, "calloc refuses an overflowing count");
+    check_nothing_live("calloc");
+}
+
+/**
+ * Check that sized frees of blocks that are not the global heap's send them back where they came from
+ */
+static void test_sized(void) {
+    tu_heap *heap = tu_heap_new(0);
+    check(heap != NULL, "tu_heap_new");
+
+    void *blocks[64];
+    for (size_t i = 0; i < 64; i++) {
+        blocks[i] = tu_heap_alloc(heap, 48, 0);
+        check(blocks[i] != NULL, "tu_heap_alloc");
+    }
+    for (size_t i = 0; i < 64; i++) {
+        tufree_sized(blocks[i], 48);
+    }
+
+    // None of the private heap's blocks may turn up in the global heap
+    for (size_t i = 0; i < 64; i++) {
+        blocks[i] = tumalloc(48);
+        tu_span *span = tu_pagemap_get(blocks[i]);
+        check(span != NULL && span->kind == TU_SPAN_HEAP, "sized free keeps private heap blocks out of the global heap");
+    }
+    for (size_t i = 0; i < 64; i++) {
+        tufree_sized(blocks[i], 48);
+    }
+    tu_heap_delete(heap);
+
+    // Sizes the large path serves may be freed with their size too
+    void *large = tumalloc(300000);
+    tufree_sized(large, 300000);
+
+    // A block realloc shrank in place is freed by its header, not by the size it was shrunk to
+    static const size_t shrinks[][2] = { { 40000, 100 }, { 60000, 40000 }, { 1000, 24 } };
+    for (size_t i = 0; i < sizeof(shrinks) / sizeof(shrinks[0]); i++) {
+        void *ptr = turealloc(tumalloc(shrinks[i][0]), shrinks[i][1]);
+        check(ptr != NULL, "realloc before sized free");
+        tufree_sized(ptr, shrinks[i][1]);
+        check_nothing_live("sized free after a shrinking realloc");
+    }
+    check_nothing_live("sized");
+}
+
+/**
+ * State shared by the threads of the threaded group
+ */
+typedef struct thread_state {
+    unsigned seed; /**< Seed of the thread's random sizes */
+    void *handoff[THREAD_SLOTS]; /**< Blocks left for the next thread to free */
+} thread_state;
+
+static thread_state STATES[THREADS]; /**< One per thread */
+static pthread_barrier_t HANDOFF; /**< Holds every thread until all have left their blocks */
+
+/**
+ * Draw the next number from a thread's generator
+ *
+ * @param seed The generator's state
+ * @return A random number
+ */
+static unsigned next_random(unsigned *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/**
+ * Allocate and free blocks of random sizes, then free the blocks another thread left
+ *
+ * @param arg The thread's index
+ * @return NULL
+ */
+static void *thread_main(void *arg) {
+    size_t index = (size_t) (uintptr_t) arg;
+    thread_state *state = &STATES[index];
+    void *slots[THREAD_SLOTS] = { 0 };
+
+    for (size_t op = 0; op < THREAD_OPS; op++) {
+        unsigned r = next_random(&state->seed);
+        size_t slot = r % THREAD_SLOTS;
+        if (slots[slot] != NULL) {
+            tufree(slots[slot]);
+            slots[slot] = NULL;
+            continue;
+        }
+
+        // Mostly small sizes, with the odd heap block and page run
+        size_t size = (r >> 9) % 64 == 0 ? (r >> 15) % 300000 + 1 : (r >> 15) % 1024 + 1;
+        switch ((r >> 12) % 8) {
+            case 0:
+                slots[slot] = tucalloc(1, size);
+                break;
+            case 1:
+                slots[slot] = tumemalign((size_t) 64 << (r % 4), size);
+                break;
+            case 2:
+                slots[slot] = turealloc(tumalloc(size / 2 + 1), size);
+                break;
+            default:
+                slots[slot] = tumalloc(size);
+                break;
+        }
+        check(slots[slot] != NULL, "allocation in a thread");
+        memset(slots[slot], (int) index, size < 64 ? size : 64);
+    }
+
+    // Leave the live blocks for the next thread, which frees them through its own cache
+    memcpy(state->handoff, slots, sizeof(slots));
+    pthread_barrier_wait(&HANDOFF);
+    thread_state *next = &STATES[(index + 1) % THREADS];
+    for (size_t slot = 0; slot < THREAD_SLOTS; slot++) {
+        tufree(next->handoff[slot]);
+    }
+    return NULL;
+}
+
+/**
+ * Check that threads allocating and freeing at once, and freeing each other's blocks, leave nothing live
+ */
+static void test_threads(void) {
+    pthread_t threads[THREADS];
+    pthread_barrier_init(&HANDOFF, NULL, THREADS);
+    for (size_t i = 0; i < THREADS; i++) {
+        STATES[i].seed = 0x9e3779b9u * (unsigned) (i + 1);
+        check(pthread_create(&threads[i], NULL, thread_main, (void *) (uintptr_t) i) == 0, "pthread_create");
+    }
+    for (size_t i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&HANDOFF);
+    check_nothing_live("threads");
+}
+
+int main(int argc, char **argv) {
+    static const struct {
+        const char *name;
+        void (*run)(void);
+    } groups[] = {
+        { "realloc", test_realloc },
+        { "memalign", test_memalign },
+        { "calloc", test_calloc },
+        { "sized", test_sized },
+        { "threads", test_threads },
+    };
+
+    int ran = 0;
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        if (argc < 2 || strcmp(argv[1], groups[i].name) == 0) {
+            groups[i].run();
+            ran = 1;
+        }
+    }
+    if (!ran) {
+        fprintf(stderr, "usage: %s [realloc|memalign|calloc|sized|threads]\n", argv[0]);
+        return 2;
+    }
+    puts("ok");
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "tumalloc.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <vector>
+
+/*
+ * Builds the C++ adapters in tumalloc.hpp and the operator new and delete
+ * replacements, and checks that each of them hands out tumalloc memory.
+ */
+
+namespace {
+
+/**
+ * Stop the test if a condition does not hold
+ *
+ * @param ok The condition
+ * @param what What was checked, printed on failure
+ */
+void check(bool ok, const char *what) {
+    if (!ok) {
+        std::fprintf(stderr, "FAILED: %s\n", what);
+        std::exit(1);
+    }
+}
+
+struct node {
+    int value;
+    node *next;
+};
+
+struct alignas(256) over_aligned {
+    char data[300];
+};
+
+/**
+ * Check the global operator new and delete replacements
+ */
+void test_new_delete() {
+    int *one = new int(42);
+    check(tumalloc_owns(one) && *one == 42, "new allocates from tumalloc");
+    delete one;
+
+    int *many = new int[1000]();
+    check(tumalloc_owns(many) && many[999] == 0, "new[] allocates from tumalloc");
+    delete[] many;
+
+    over_aligned *over = new over_aligned;
+    check(tumalloc_owns(over) && reinterpret_cast<std::uintptr_t>(over) % alignof(over_aligned) == 0,
+          "aligned new keeps the alignment");
+    delete over;
+
+    node *quiet = new (std::nothrow) node{1, nullptr};
+    check(tumalloc_owns(quiet), "nothrow new allocates from tumalloc");
+    delete quiet;
+}
+
+/**
+ * Check tu::fixed, tu::allocator and tu::resource on the global heap and on private ones
+ */
+void test_adapters() {
+    static_assert(tu::fixed<sizeof(node)>::size_class != 0, "small sizes have a class");
+    static_assert(tu::fixed<1 << 20>::size_class == 0, "large sizes have none");
+    for (int i = 0; i < 1000; i++) {
+        node *n = static_cast<node *>(tu::fixed<sizeof(node)>::allocate());
+        n->value = i;
+        tu::fixed<sizeof(node)>::deallocate(n);
+    }
+
+    std::vector<int, tu::allocator<int>> global;
+    for (int i = 0; i < 10000; i++) {
+        global.push_back(i);
+    }
+    check(tumalloc_owns(global.data()) && global[9999] == 9999, "tu::allocator uses the global heap");
+
+    for (int flags : {0, TU_HEAP_ARENA}) {
+        tu::heap heap(flags);
+        std::map<int, int, std::less<int>, tu::allocator<std::pair<const int, int>>> map(heap);
+        for (int i = 0; i < 5000; i++) {
+            map[i % 1000] = i;
+            if (i % 3 == 0) {
+                map.erase((i * 7) % 1000);
+            }
+        }
+        std::vector<over_aligned, tu::allocator<over_aligned>> aligned(heap);
+        aligned.resize(20);
+        check(reinterpret_cast<std::uintptr_t>(aligned.data()) % alignof(over_aligned) == 0,
+              "tu::allocator keeps the alignment on a private heap");
+
+        tu::resource pool(heap);
+        std::pmr::vector<int> pmr(&pool);
+        for (int i = 0; i < 10000; i++) {
+            pmr.push_back(i);
+        }
+        check(pmr[9999] == 9999 && pool.is_equal(tu::resource(heap)) && !pool.is_equal(*tu::global_resource()),
+              "tu::resource draws from its heap");
+    }
+
+    std::pmr::vector<int> shared(tu::global_resource());
+    shared.assign(1000, 7);
+    check(tumalloc_owns(shared.data()), "tu::global_resource uses the global heap");
+}
+
+} // namespace
+
+int main() {
+    test_new_delete();
+    test_adapters();
+    std::puts("ok");
+    return 0;
+}
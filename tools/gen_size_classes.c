@@ -0,0 +1,133 @@
+#include "size_class_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CLASSES 255 /**< Most classes the lookup table can number */
+
+/*
+ * Generates size_classes.h from two targets: the most internal fragmentation a
+ * request may suffer, as a fraction of its block, and the most classes there may
+ * be. Classes up to the lookup limit are spaced in 16-byte steps as widely as the
+ * fragmentation target allows; above it, each power of two gets as few geometric
+ * classes as meet the target. If that takes too many classes, the target is
+ * relaxed until it fits.
+ *
+ *     gen_size_classes OUTPUT [--max-waste F] [--max-classes N] [--lookup-max B] [--small-max B]
+ */
+
+/**
+ * Work out the classes for a fragmentation target
+ *
+ * @param sizes Filled with the class sizes, room for MAX_CLASSES
+ * @param waste The most a request may lose to rounding, as a fraction of its block
+ * @param lookup_max Biggest size classed through the lookup table, a power of two
+ * @param small_max Biggest size given a class, a power of two at least lookup_max
+ * @param step_bits Set to log2 of the classes per power of two above lookup_max
+ * @return The number of classes, or 0 if there would be more than MAX_CLASSES
+ */
+static size_t make_classes(uint32_t *sizes, double waste, size_t lookup_max, size_t small_max, unsigned *step_bits) {
+    size_t count = 0;
+
+    // The worst case for a class is the request one byte above the class before it
+    size_t prev = 0;
+    while (prev < lookup_max) {
+        size_t next = (size_t) ((double) (prev + 1) / (1.0 - waste)) / TABLE_GRANULE * TABLE_GRANULE;
+        if (next < prev + TABLE_GRANULE) {
+            next = prev + TABLE_GRANULE;
+        }
+        if (next > lookup_max) {
+            next = lookup_max;
+        }
+        if (count == MAX_CLASSES) {
+            return 0;
+        }
+        sizes[count++] = (uint32_t) next;
+        prev = next;
+    }
+
+    // Geometric classes lose at most one step in 2^bits + 1 steps
+    unsigned bits = 0;
+    while (1.0 / ((1u << bits) + 1) > waste && bits < 8) {
+        bits++;
+    }
+    *step_bits = bits;
+    for (size_t base = lookup_max; base < small_max; base <<= 1) {
+        for (size_t step = 1; step <= ((size_t) 1 << bits); step++) {
+            if (count == MAX_CLASSES) {
+                return 0;
+            }
+            sizes[count++] = (uint32_t) (base + step * (base >> bits));
+        }
+    }
+    return count;
+}
+
+/**
+ * Check that a size is a power of two of at least the lookup step
+ *
+ * @param size The size
+ * @return Non-zero if it is
+ */
+static int valid_power(size_t size) {
+    return size >= TABLE_GRANULE && (size & (size - 1)) == 0;
+}
+
+/**
+ * Generate the size-class table
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s OUTPUT [--max-waste F] [--max-classes N] [--lookup-max B] [--small-max B]\n", argv[0]);
+        return 1;
+    }
+
+    double waste = 0.125;
+    size_t max_classes = 72;
+    size_t lookup_max = 1024;
+    size_t small_max = 32768;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--max-waste") == 0) {
+            waste = strtod(argv[i + 1], NULL);
+        } else if (strcmp(argv[i], "--max-classes") == 0) {
+            max_classes = strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "--lookup-max") == 0) {
+            lookup_max = strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "--small-max") == 0) {
+            small_max = strtoul(argv[i + 1], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (!valid_power(lookup_max) || !valid_power(small_max) || small_max < lookup_max ||
+        waste <= 0.0 || waste >= 1.0 || max_classes == 0) {
+        fprintf(stderr, "invalid size-class parameters\n");
+        return 1;
+    }
+
+    // Relax the fragmentation target until the classes fit in the count asked for
+    uint32_t sizes[MAX_CLASSES];
+    unsigned step_bits = 0;
+    size_t count;
+    double target = waste;
+    while ((count = make_classes(sizes, target, lookup_max, small_max, &step_bits)) == 0 || count > max_classes) {
+        if (target >= 0.5) {
+            fprintf(stderr, "cannot fit size classes up to %zu in %zu classes\n", small_max, max_classes);
+            return 1;
+        }
+        target += 0.005;
+    }
+    if (target != waste) {
+        fprintf(stderr, "gen_size_classes: relaxed fragmentation target to %.3f to fit %zu classes\n", target, max_classes);
+    }
+
+    FILE *out = fopen(argv[1], "w");
+    if (out == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    write_size_class_table(out, sizes, count, lookup_max, step_bits, "tools/gen_size_classes");
+    return fclose(out) == 0 ? 0 : 1;
+}
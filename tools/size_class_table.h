@@ -0,0 +1,74 @@
+#ifndef CYB3053_PROJECT2_SIZE_CLASS_TABLE_H
+#define CYB3053_PROJECT2_SIZE_CLASS_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Writer for size_classes.h, shared by the tools that produce size-class tables.
+ *
+ * Requests up to lookup_max bytes find their class in a table indexed by the size
+ * in 16-byte steps. Above that, up to the last class, each power of two is split
+ * into 2^step_bits geometric classes, so the class is found from the position of
+ * the highest bit instead; those classes must be exactly the ones that formula gives.
+ */
+
+#define TABLE_GRANULE 16 /**< Step of the lookup table, and the alignment of every class */
+
+/**
+ * Write a size-class table as a header
+ *
+ * @param out Where to write it
+ * @param sizes Payload size of each class, ascending, each a multiple of 16
+ * @param count Number of classes, at most 255
+ * @param lookup_max Biggest size found through the lookup table; a class size, and a power of two if classes follow it
+ * @param step_bits log2 of the number of classes per power of two above lookup_max
+ * @param source What produced the table, for the comment at the top
+ */
+static void write_size_class_table(FILE *out, const uint32_t *sizes, size_t count, size_t lookup_max,
+                                   unsigned step_bits, const char *source) {
+    size_t first_step = 1;
+    while (first_step <= count && sizes[first_step - 1] <= lookup_max) {
+        first_step++;
+    }
+    unsigned lookup_shift = 0;
+    while (((size_t) 1 << lookup_shift) < lookup_max) {
+        lookup_shift++;
+    }
+
+    fprintf(out, "#ifndef CYB3053_PROJECT2_SIZE_CLASSES_H\n#define CYB3053_PROJECT2_SIZE_CLASSES_H\n\n");
+    fprintf(out, "/*\n * Size classes for small blocks, generated by %s. Do not edit.\n", source);
+    fprintf(out, " *\n * Requests up to TU_LOOKUP_MAX bytes find their class in TU_CLASS_LOOKUP, indexed\n");
+    fprintf(out, " * by the size in 16-byte steps. Bigger requests, up to TU_SMALL_MAX, take their\n");
+    fprintf(out, " * class from the highest set bit of the size and the TU_CLASS_STEP_BITS below it.\n */\n\n");
+    fprintf(out, "#define TU_NUM_CLASSES %zu /**< Number of size classes; classes are numbered from 1 */\n", count);
+    fprintf(out, "#define TU_SMALL_MAX %u /**< Biggest request served from a size class */\n", (unsigned) sizes[count - 1]);
+    fprintf(out, "#define TU_LOOKUP_MAX %zu /**< Biggest request whose class is in TU_CLASS_LOOKUP */\n", lookup_max);
+    fprintf(out, "#define TU_LOOKUP_SHIFT %u /**< log2 of TU_LOOKUP_MAX */\n", lookup_shift);
+    fprintf(out, "#define TU_CLASS_STEP_BITS %u /**< log2 of the classes per power of two above TU_LOOKUP_MAX */\n", step_bits);
+    fprintf(out, "#define TU_FIRST_STEP_CLASS %zu /**< First class above TU_LOOKUP_MAX */\n\n", first_step);
+
+    fprintf(out, "/**\n * Payload size of each class, from class 1 up\n */\n#define TU_CLASS_SIZES \\\n");
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s%u%s", i % 10 == 0 ? "    " : " ", (unsigned) sizes[i],
+                i + 1 == count ? "\n\n" : (i % 10 == 9 ? ", \\\n" : ","));
+    }
+
+    fprintf(out, "/**\n * Class for each request size up to TU_LOOKUP_MAX, indexed by the size rounded up to 16 bytes and divided by 16\n */\n");
+    fprintf(out, "#define TU_CLASS_LOOKUP \\\n");
+    size_t entries = lookup_max / TABLE_GRANULE + 1;
+    size_t cls = 1;
+    for (size_t i = 0; i < entries; i++) {
+        size_t size = i ? i * TABLE_GRANULE : 1;
+        while (sizes[cls - 1] < size) {
+            cls++;
+        }
+        fprintf(out, "%s%zu%s", i % 20 == 0 ? "    " : " ", cls,
+                i + 1 == entries ? "\n\n" : (i % 20 == 19 ? ", \\\n" : ","));
+    }
+
+    fprintf(out, "#endif //CYB3053_PROJECT2_SIZE_CLASSES_H\n");
+}
+
+#endif //CYB3053_PROJECT2_SIZE_CLASS_TABLE_H
@@ -0,0 +1,156 @@
+#include "size_class_table.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_CLASSES 255 /**< Most classes the lookup table can number */
+
+/*
+ * Fits size classes to a workload. Reads a histogram dumped by a build with
+ * TUMALLOC_HISTOGRAM and picks the class sizes that waste the fewest bytes to
+ * rounding over the requests it counted, then writes them as size_classes.h,
+ * ready for TUMALLOC_SIZE_CLASSES_FILE:
+ *
+ *     TUMALLOC_HISTOGRAM_FILE=sizes.txt ./service      (a %p in the name becomes the process ID)
+ *     tune_size_classes sizes.txt size_classes.h [--classes N] [--small-max B]
+ *
+ * Every class is a multiple of 16 and the last one is always the small limit,
+ * so the tuned table covers the same requests the generated one does; requests
+ * above the limit are ignored. The search is a dynamic program over the 16-byte
+ * steps: the best n classes ending at step j extend the best n - 1 ending at
+ * some step i below it, paying the rounding of every request between the two.
+ */
+
+/**
+ * Read a histogram into per-step counts
+ *
+ * @param path The histogram file
+ * @param counts Filled with the number of requests rounding up to each 16-byte step
+ * @param steps Number of steps covered
+ * @return 0 on success, -1 if the file could not be read
+ */
+static int read_histogram(const char *path, double *counts, size_t steps) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        unsigned long long size, count;
+        if (line[0] == '#' || sscanf(line, "%llu %llu", &size, &count) != 2) {
+            continue;
+        }
+        size_t step = (size_t) ((size + TABLE_GRANULE - 1) / TABLE_GRANULE);
+        if (step == 0) {
+            step = 1;
+        }
+        if (step < steps) {
+            counts[step] += (double) count;
+        }
+    }
+    fclose(in);
+    return 0;
+}
+
+/**
+ * Fit size classes to a histogram
+ */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s HISTOGRAM OUTPUT [--classes N] [--small-max B]\n", argv[0]);
+        return 1;
+    }
+
+    size_t classes = 64;
+    size_t small_max = 32768;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--classes") == 0) {
+            classes = strtoul(argv[i + 1], NULL, 0);
+        } else if (strcmp(argv[i], "--small-max") == 0) {
+            small_max = strtoul(argv[i + 1], NULL, 0);
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    size_t top = small_max / TABLE_GRANULE;
+    if (small_max % TABLE_GRANULE != 0 || top == 0 || classes == 0 || classes > MAX_CLASSES) {
+        fprintf(stderr, "invalid tuning parameters\n");
+        return 1;
+    }
+    if (classes > top) {
+        classes = top;
+    }
+
+    // Prefix sums of the counts and of the bytes asked for, so any range's rounding costs O(1)
+    double *counts = calloc(top + 1, sizeof(double));
+    double *prefix_count = calloc(top + 1, sizeof(double));
+    double *prefix_bytes = calloc(top + 1, sizeof(double));
+    double *best = malloc((top + 1) * sizeof(double));
+    double *next = malloc((top + 1) * sizeof(double));
+    size_t *choice = malloc(classes * (top + 1) * sizeof(size_t));
+    if (!counts || !prefix_count || !prefix_bytes || !best || !next || !choice) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (read_histogram(argv[1], counts, top + 1) != 0) {
+        return 1;
+    }
+    for (size_t step = 1; step <= top; step++) {
+        prefix_count[step] = prefix_count[step - 1] + counts[step];
+        prefix_bytes[step] = prefix_bytes[step - 1] + counts[step] * (double) step;
+    }
+
+    // best[j]: least waste, in steps, with the classes so far and the last one at step j
+    for (size_t j = 1; j <= top; j++) {
+        best[j] = (double) j * prefix_count[j] - prefix_bytes[j];
+        choice[j] = 0;
+    }
+    for (size_t n = 1; n < classes; n++) {
+        for (size_t j = 1; j <= top; j++) {
+            next[j] = best[j];
+            choice[n * (top + 1) + j] = j;
+            for (size_t i = 1; i < j; i++) {
+                double waste = best[i] + (double) j * (prefix_count[j] - prefix_count[i]) - (prefix_bytes[j] - prefix_bytes[i]);
+                if (waste < next[j]) {
+                    next[j] = waste;
+                    choice[n * (top + 1) + j] = i;
+                }
+            }
+        }
+        memcpy(best, next, (top + 1) * sizeof(double));
+    }
+
+    // Walk the choices back from the small limit, dropping classes the fit did not need
+    uint32_t sizes[MAX_CLASSES];
+    size_t count = 0;
+    size_t j = top;
+    for (size_t n = classes; n-- > 0 && j > 0;) {
+        size_t i = choice[n * (top + 1) + j];
+        if (i != j) {
+            sizes[count++] = (uint32_t) (j * TABLE_GRANULE);
+            j = i;
+        }
+    }
+    for (size_t a = 0, b = count - 1; a < b; a++, b--) {
+        uint32_t swap = sizes[a];
+        sizes[a] = sizes[b];
+        sizes[b] = swap;
+    }
+
+    double asked = prefix_bytes[top] * TABLE_GRANULE;
+    double wasted = best[top] * TABLE_GRANULE;
+    fprintf(stderr, "tune_size_classes: %zu classes, %.2f%% of small request bytes lost to rounding\n",
+            count, asked > 0 ? 100.0 * wasted / (asked + wasted) : 0.0);
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        perror(argv[2]);
+        return 1;
+    }
+    write_size_class_table(out, sizes, count, small_max, 0, "tools/tune_size_classes");
+    return fclose(out) == 0 ? 0 : 1;
+}
@@ -0,0 +1,449 @@
+#include "alloc.h"
+#include "output.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RSS_INTERVAL 1024 /**< Events replayed between readings of the resident set size */
+
+/*
+ * Replays an allocation trace recorded by a TUMALLOC_TRACE build against an
+ * allocator and reports how long it took, how much memory it held at its peak
+ * and how much of that was fragmentation:
+ *
+ *     TUMALLOC_TRACE_FILE=trace.%p ./service           (a %p in the name becomes the process ID)
+ *     tureplay trace.1234 [--engine tumalloc|libc]
+ *
+ * The libc engine calls malloc and friends, so any other allocator can be
+ * measured by preloading it. Every thread's events are merged by time and
+ * replayed on one thread, so the report compares allocators on the same sequence
+ * of requests rather than on their scaling. The trace is read and the tables are
+ * set up before the replay starts, and the resident set size is measured from
+ * there, so it counts only what the allocator takes on during the replay.
+ * Frees of blocks the trace never saw allocated, such as those of private heaps,
+ * are counted as unmatched and skipped.
+ */
+
+/**
+ * One event of the trace, decoded
+ */
+typedef struct event {
+    uint64_t time; /**< When it happened, in nanoseconds */
+    uint64_t seq; /**< Position in the trace, which orders events of the same time */
+    uint64_t size; /**< The size asked for, or the alignment of TU_TRACE_MEMALIGN */
+    uint64_t extra; /**< The size asked for with TU_TRACE_MEMALIGN */
+    uint64_t old_id; /**< Id of the block given to TU_TRACE_REALLOC */
+    uint64_t id; /**< Id of the block allocated, or freed by TU_TRACE_FREE */
+    uint32_t thread; /**< Thread number */
+    uint8_t op; /**< What happened, one of tu_trace_op */
+} event;
+
+/**
+ * Decoding state of one thread
+ */
+typedef struct thread_state {
+    uint64_t last_time; /**< Time of the thread's previous event */
+    uint64_t last_id; /**< Id in the thread's previous event */
+} thread_state;
+
+/**
+ * A block the replay holds, by the id it had in the trace
+ */
+typedef struct slot {
+    uint64_t id; /**< Id in the trace, 0 for an empty slot */
+    void *ptr; /**< The block the engine gave the replay */
+    uint64_t size; /**< The size asked for */
+} slot;
+
+/**
+ * An allocator to replay against
+ */
+typedef struct engine {
+    const char *name; /**< Name given to --engine */
+    void *(*malloc)(size_t size); /**< Allocate */
+    void *(*calloc)(size_t num, size_t size); /**< Allocate zeroed */
+    void *(*realloc)(void *ptr, size_t size); /**< Resize */
+    void *(*memalign)(size_t alignment, size_t size); /**< Allocate aligned */
+    void (*free)(void *ptr); /**< Free */
+} engine;
+
+static slot *SLOTS; /**< Open addressing table of the blocks held, by id */
+static size_t SLOT_MASK; /**< Number of slots minus one */
+
+/**
+ * Allocate from tumalloc
+ *
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *tu_engine_malloc(size_t size) {
+    return (tumalloc)(size);
+}
+
+/**
+ * Allocate zeroed memory from tumalloc
+ *
+ * @param num How many elements to allocate
+ * @param size The size of each element
+ * @return A pointer to the block
+ */
+static void *tu_engine_calloc(size_t num, size_t size) {
+    return (tucalloc)(num, size);
+}
+
+/**
+ * Resize a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ * @param size The new size
+ * @return A pointer to the resized block
+ */
+static void *tu_engine_realloc(void *ptr, size_t size) {
+    return (turealloc)(ptr, size);
+}
+
+/**
+ * Allocate aligned memory from tumalloc
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block
+ */
+static void *tu_engine_memalign(size_t alignment, size_t size) {
+    return (tumemalign)(alignment, size);
+}
+
+/**
+ * Free a tumalloc block
+ *
+ * @param ptr The block, or NULL
+ */
+static void tu_engine_free(void *ptr) {
+    (tufree)(ptr);
+}
+
+/**
+ * Allocate aligned memory from libc
+ *
+ * @param alignment The alignment, a power of two
+ * @param size The amount of memory to allocate
+ * @return A pointer to the block, or NULL
+ */
+static void *libc_memalign(size_t alignment, size_t size) {
+    void *ptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+static const engine ENGINES[] = { /**< Engines --engine can pick, the default first */
+    { "tumalloc", tu_engine_malloc, tu_engine_calloc, tu_engine_realloc, tu_engine_memalign, tu_engine_free },
+    { "libc", malloc, calloc, realloc, libc_memalign, free },
+};
+
+/**
+ * Read the monotonic clock
+ *
+ * @return The time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * Find the slot of an id, or the empty slot it would go in
+ *
+ * @param id The id, not 0
+ * @return The slot
+ */
+static slot *find_slot(uint64_t id) {
+    size_t i = (size_t) (id * 0x9e3779b97f4a7c15ULL) & SLOT_MASK;
+    while (SLOTS[i].id != 0 && SLOTS[i].id != id) {
+        i = (i + 1) & SLOT_MASK;
+    }
+    return &SLOTS[i];
+}
+
+/**
+ * Empty a slot, moving later slots of its run back so lookups still find them
+ *
+ * @param hole The slot
+ */
+static void clear_slot(slot *hole) {
+    size_t i = (size_t) (hole - SLOTS);
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & SLOT_MASK;
+        if (SLOTS[j].id == 0) {
+            break;
+        }
+        // An entry can fill the hole if the hole lies between its home slot and where it sits
+        size_t home = (size_t) (SLOTS[j].id * 0x9e3779b97f4a7c15ULL) & SLOT_MASK;
+        if (((j - home) & SLOT_MASK) >= ((j - i) & SLOT_MASK)) {
+            SLOTS[i] = SLOTS[j];
+            i = j;
+        }
+    }
+    SLOTS[i].id = 0;
+}
+
+/**
+ * Order events by time, then by their position in the trace
+ *
+ * @param a The first event
+ * @param b The second event
+ * @return Negative, zero or positive as a sorts before, with or after b
+ */
+static int compare_events(const void *a, const void *b) {
+    const event *x = a;
+    const event *y = b;
+    if (x->time != y->time) {
+        return x->time < y->time ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Decode a trace
+ *
+ * @param data The trace
+ * @param length Its length
+ * @param events Set to the events, in the order they were recorded in per thread
+ * @param count Set to the number of events
+ * @param threads Set to the number of threads
+ * @return 0 on success, -1 if the trace is malformed or memory ran out
+ */
+static int read_trace(const uint8_t *data, size_t length, event **events, size_t *count, size_t *threads) {
+    const uint8_t *in = data + TU_TRACE_MAGIC_SIZE;
+    const uint8_t *end = data + length;
+    uint64_t start;
+    if (length < TU_TRACE_MAGIC_SIZE || memcmp(data, TU_TRACE_MAGIC, TU_TRACE_MAGIC_SIZE) != 0 ||
+        tu_trace_get(&in, end, &start) != 0) {
+        return -1;
+    }
+
+    // Every event takes at least three bytes
+    event *list = malloc((length / 3 + 1) * sizeof(event));
+    thread_state *states = NULL;
+    size_t state_count = 0;
+    size_t n = 0;
+    if (list == NULL) {
+        return -1;
+    }
+    while (in < end) {
+        uint64_t thread, chunk;
+        if (tu_trace_get(&in, end, &thread) != 0 || tu_trace_get(&in, end, &chunk) != 0 ||
+            thread == 0 || chunk > (uint64_t) (end - in)) {
+            return -1;
+        }
+        if (thread > state_count) {
+            size_t grown = thread * 2;
+            thread_state *bigger = realloc(states, grown * sizeof(thread_state));
+            if (bigger == NULL) {
+                return -1;
+            }
+            for (size_t i = state_count; i < grown; i++) {
+                bigger[i] = (thread_state) { start, 0 };
+            }
+            states = bigger;
+            state_count = grown;
+        }
+        thread_state *state = &states[thread - 1];
+        if (thread > *threads) {
+            *threads = thread;
+        }
+
+        const uint8_t *chunk_end = in + chunk;
+        while (in < chunk_end) {
+            event *e = &list[n];
+            uint64_t delta, value;
+            *e = (event) { .seq = n, .thread = (uint32_t) thread, .op = *in++ };
+            if (e->op > TU_TRACE_MEMALIGN || tu_trace_get(&in, chunk_end, &delta) != 0) {
+                return -1;
+            }
+            state->last_time += delta;
+            e->time = state->last_time;
+            if (e->op != TU_TRACE_FREE && tu_trace_get(&in, chunk_end, &e->size) != 0) {
+                return -1;
+            }
+            if (e->op == TU_TRACE_MEMALIGN && tu_trace_get(&in, chunk_end, &e->extra) != 0) {
+                return -1;
+            }
+            if (e->op == TU_TRACE_REALLOC) {
+                if (tu_trace_get(&in, chunk_end, &value) != 0) {
+                    return -1;
+                }
+                state->last_id += (uint64_t) tu_trace_unzigzag(value);
+                e->old_id = state->last_id;
+            }
+            if (tu_trace_get(&in, chunk_end, &value) != 0) {
+                return -1;
+            }
+            state->last_id += (uint64_t) tu_trace_unzigzag(value);
+            e->id = state->last_id;
+            n++;
+        }
+    }
+    free(states);
+    *events = list;
+    *count = n;
+    return 0;
+}
+
+/**
+ * Replay an allocation trace against an allocator
+ */
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s TRACE [--engine tumalloc|libc]\n", argv[0]);
+        return 1;
+    }
+
+    const engine *eng = &ENGINES[0];
+    for (int i = 2; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--engine") == 0) {
+            eng = NULL;
+            for (size_t e = 0; e < sizeof(ENGINES) / sizeof(ENGINES[0]); e++) {
+                if (strcmp(argv[i + 1], ENGINES[e].name) == 0) {
+                    eng = &ENGINES[e];
+                }
+            }
+            if (eng == NULL) {
+                fprintf(stderr, "unknown engine %s\n", argv[i + 1]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    const uint8_t *data = info.st_size > 0
+        ? mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    event *events;
+    size_t count = 0;
+    size_t threads = 0;
+    if (data == MAP_FAILED || read_trace(data, (size_t) info.st_size, &events, &count, &threads) != 0) {
+        fprintf(stderr, "%s: not a readable trace\n", argv[1]);
+        return 1;
+    }
+    munmap((void *) data, (size_t) info.st_size);
+    close(fd);
+    qsort(events, count, sizeof(event), compare_events);
+
+    // Room for every block at once at half load, touched now so it is resident before the replay
+    size_t slots = 16;
+    while (slots < count * 2) {
+        slots *= 2;
+    }
+    SLOTS = malloc(slots * sizeof(slot));
+    if (SLOTS == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    memset(SLOTS, 0, slots * sizeof(slot));
+    SLOT_MASK = slots - 1;
+
+    size_t baseline = tu_resident_bytes();
+    uint64_t elapsed = 0;
+    uint64_t live = 0, peak_live = 0, live_at_peak = 0;
+    size_t peak_rss = 0;
+    size_t unmatched = 0;
+    for (size_t next = 0; next < count;) {
+        size_t stop = next + RSS_INTERVAL < count ? next + RSS_INTERVAL : count;
+        uint64_t begin = now_ns();
+        for (; next < stop; next++) {
+            const event *e = &events[next];
+            void *ptr;
+            uint64_t size = e->size;
+            switch (e->op) {
+                case TU_TRACE_MALLOC:
+                    ptr = eng->malloc(size);
+                    break;
+                case TU_TRACE_CALLOC:
+                    ptr = eng->calloc(1, size);
+                    break;
+                case TU_TRACE_MEMALIGN:
+                    size = e->extra;
+                    ptr = eng->memalign(e->size, size);
+                    break;
+                case TU_TRACE_REALLOC: {
+                    void *old = NULL;
+                    if (e->old_id != 0) {
+                        slot *held = find_slot(e->old_id);
+                        if (held->id != 0) {
+                            old = held->ptr;
+                            live -= held->size;
+                            clear_slot(held);
+                        } else {
+                            unmatched++;
+                        }
+                    }
+                    ptr = eng->realloc(old, size);
+                    break;
+                }
+                default: {
+                    slot *held = find_slot(e->id);
+                    if (held->id != 0) {
+                        eng->free(held->ptr);
+                        live -= held->size;
+                        clear_slot(held);
+                    } else {
+                        unmatched++;
+                    }
+                    continue;
+                }
+            }
+            if (ptr == NULL) {
+                continue;
+            }
+            // An allocation that failed when recorded has nothing to free it later
+            if (e->id == 0) {
+                eng->free(ptr);
+                continue;
+            }
+            slot *held = find_slot(e->id);
+            if (held->id != 0) {
+                // Two threads' clocks put a reuse of the address before its free; drop the older block
+                eng->free(held->ptr);
+                live -= held->size;
+                unmatched++;
+            }
+            *held = (slot) { e->id, ptr, size };
+            live += size;
+            if (live > peak_live) {
+                peak_live = live;
+            }
+        }
+        elapsed += now_ns() - begin;
+
+        size_t rss = tu_resident_bytes();
+        rss = rss > baseline ? rss - baseline : 0;
+        if (rss > peak_rss) {
+            peak_rss = rss;
+            live_at_peak = live;
+        }
+    }
+
+    printf("tureplay: engine %s, %zu events from %zu threads, %zu unmatched\n", eng->name, count, threads, unmatched);
+    printf("time           %.6f s (%.1f ns per event)\n", (double) elapsed / 1e9,
+           count ? (double) elapsed / (double) count : 0.0);
+    printf("peak live      %llu bytes\n", (unsigned long long) peak_live);
+    printf("peak rss       %zu bytes above the %zu at start\n", peak_rss, baseline);
+    printf("fragmentation  %.3f of the rss at its peak\n",
+           peak_rss > live_at_peak ? 1.0 - (double) live_at_peak / (double) peak_rss : 0.0);
+    return 0;
+}